@@ -0,0 +1,135 @@
+// arena.c ... Arena allocators
+// part of signature indexed files
+// An Arena hands out memory by bumping a pointer through a
+//   chain of large blocks; nothing is freed individually
+// Everything is released at once by resetArena()/freeArena(),
+//   e.g. when a query is closed
+// Blocks are 2MB, backed by huge pages where the system has
+//   them reserved, and by transparent huge pages otherwise
+// Each open Query has an Arena to itself, so queries in
+//   different threads never contend for the allocator; Arenas
+//   are reset and kept by their relation for later queries
+//   (see query.c), so a query does not map fresh memory
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "defs.h"
+#include "arena.h"
+
+#define ARENABLOCK (2*1024*1024) // one huge page
+#define ARENAALIGN 16
+
+typedef struct _Block {
+	struct _Block *next; // previously filled block
+	size_t size;         // bytes in this block, incl. header
+	size_t used;         // bytes handed out, incl. header
+} Block;
+
+// block header, rounded up so allocations are ARENAALIGN-aligned
+#define HEADERSIZE ((sizeof(Block) + ARENAALIGN-1) & ~(size_t)(ARENAALIGN-1))
+
+struct _ArenaRep {
+	Block *blocks;  // current block first
+	size_t limit;   // most bytes the arena may map (0 = no limit)
+	size_t mapped;  // bytes currently mapped
+};
+
+// map a new block of size bytes (a multiple of ARENABLOCK)
+
+static Block *newBlock(size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE,
+	                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (mem == MAP_FAILED) {
+		// no reserved huge pages; ask for transparent ones
+		mem = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) return NULL;
+		madvise(mem, size, MADV_HUGEPAGE);
+	}
+	Block *b = mem;
+	b->next = NULL;
+	b->size = size;
+	b->used = HEADERSIZE;
+	return b;
+}
+
+// create a new, initially empty arena
+// limit bounds the memory it may ever map (0 = no limit)
+
+Arena newArena(size_t limit)
+{
+	Arena a = malloc(sizeof(struct _ArenaRep));
+	assert(a != NULL);
+	a->blocks = NULL;
+	a->limit = limit;
+	a->mapped = 0;
+	return a;
+}
+
+// allocate n bytes (zeroed) from an arena
+// - fresh blocks come zeroed from mmap(); resetArena() re-zeroes
+// returns NULL if that would take the arena over its limit
+
+void *arenaAlloc(Arena a, size_t n)
+{
+	assert(a != NULL);
+	n = (n + ARENAALIGN-1) & ~(size_t)(ARENAALIGN-1);
+	Block *b = a->blocks;
+	if (b == NULL || b->size - b->used < n) {
+		size_t need = HEADERSIZE + n;
+		size_t size = ARENABLOCK;
+		while (size < need) size += ARENABLOCK;
+		if (a->limit > 0 && a->mapped + size > a->limit)
+			return NULL;
+		b = newBlock(size);
+		if (b == NULL) return NULL;
+		b->next = a->blocks;
+		a->blocks = b;
+		a->mapped += b->size;
+	}
+	void *mem = (Byte *)b + b->used;
+	b->used += n;
+	return mem;
+}
+
+// release everything allocated from an arena
+// keeps one standard (ARENABLOCK) block mapped for re-use;
+//   bigger blocks, made for one large allocation, are unmapped
+//   so a pooled arena does not hold on to them
+
+void resetArena(Arena a)
+{
+	assert(a != NULL);
+	Block *keep = NULL;
+	Block *b = a->blocks;
+	while (b != NULL) {
+		Block *next = b->next;
+		if (keep == NULL && b->size == ARENABLOCK)
+			keep = b;
+		else {
+			a->mapped -= b->size;
+			munmap(b, b->size);
+		}
+		b = next;
+	}
+	a->blocks = keep;
+	if (keep == NULL) return;
+	keep->next = NULL;
+	memset((Byte *)keep + HEADERSIZE, 0, keep->used - HEADERSIZE);
+	keep->used = HEADERSIZE;
+}
+
+// release an arena and all of its memory
+
+void freeArena(Arena a)
+{
+	assert(a != NULL);
+	Block *b = a->blocks;
+	while (b != NULL) {
+		Block *next = b->next;
+		munmap(b, b->size);
+		b = next;
+	}
+	free(a);
+}
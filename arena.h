@@ -0,0 +1,17 @@
+// arena.h ... interface to Arena allocators
+// part of signature indexed files
+// See arena.c for details on functions
+
+#ifndef ARENA_H
+#define ARENA_H 1
+
+#include <stddef.h>
+
+typedef struct _ArenaRep *Arena;
+
+Arena newArena(size_t limit);
+void *arenaAlloc(Arena a, size_t n);
+void resetArena(Arena a);
+void freeArena(Arena a);
+
+#endif
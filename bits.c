@@ -7,9 +7,11 @@
 // Written by John Shepherd, March 2019
 
 #include <assert.h>
+#include <unistd.h>
 #include "defs.h"
 #include "bits.h"
 #include "page.h"
+#include "arena.h"
 
 typedef struct _BitsRep
 {
@@ -33,6 +35,19 @@ Bits newBits(int nbits)
 	return new;
 }
 
+// create a new Bits object in an Arena
+// it goes when the Arena is reset; never call freeBits() on it
+
+Bits newBitsIn(Arena a, int nbits)
+{
+	Count nbytes = iceil(nbits, 8);
+	Bits new = arenaAlloc(a, 2 * sizeof(Count) + nbytes);
+	assert(new != NULL);
+	new->nbits = nbits;
+	new->nbytes = nbytes;
+	return new;
+}
+
 // release memory associated with a Bits object
 
 void freeBits(Bits b)
@@ -59,6 +74,8 @@ Bool bitIsSet(Bits b, int position)
 }
 
 // check whether one Bits b1 is a subset of Bits b2
+// - compared a byte at a time; bytes where b1 is zero (e.g.
+//   the CATC regions of unbound attributes) cost nothing
 
 Bool isSubset(Bits b1, Bits b2)
 {
@@ -67,13 +84,8 @@ Bool isSubset(Bits b1, Bits b2)
 	//TODO
 	for (int i = 0; i < b2->nbytes; i++)
 	{
-		for (int j = 0; j < 8; j++)
-		{
-			if ((b1->bitstring[i] & (1 << j)) && !(b2->bitstring[i] & (1 << j)))
-			{
-				return FALSE;
-			}
-		}
+		if (b1->bitstring[i] & ~b2->bitstring[i])
+			return FALSE;
 	}
 	return TRUE;
 }
@@ -120,10 +132,7 @@ void unsetAllBits(Bits b)
 {
 	assert(b != NULL);
 	//TODO
-	for (int i = 0; i < b->nbytes; i++)
-	{
-		b->bitstring[i] |= 0;
-	}
+	memset(b->bitstring, 0, b->nbytes);
 }
 
 // bitwise AND ... b1 = b1 & b2
@@ -202,6 +211,27 @@ void putBits(Page p, Offset pos, Bits b)
 	memcpy(address, b->bitstring, b->nbytes);
 }
 
+// read a bit-string (of length b->nbytes) from the
+// current position in a file into a BitsRep structure
+// returns FALSE if the file does not hold that many bytes
+
+Bool readBits(File f, Bits b)
+{
+	assert(b != NULL);
+	ssize_t n = read(f, b->bitstring, b->nbytes);
+	return (n == b->nbytes);
+}
+
+// write the bit-string array in a BitsRep structure
+// at the current position in a file
+
+void writeBits(File f, Bits b)
+{
+	assert(b != NULL);
+	ssize_t n = write(f, b->bitstring, b->nbytes);
+	assert(n == b->nbytes);
+}
+
 // show Bits on stdout
 // display in order MSB to LSB
 // do not append '\n'
@@ -2,66 +2,264 @@
 // part of signature indexed files
 // Written by John Shepherd, March 2019
 
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "defs.h"
 #include "reln.h"
 #include "query.h"
 #include "bsig.h"
 #include "psig.h"
+#include "page.h"
+#include "arena.h"
+#include "qcache.h"
+
+// Bit-slices are stored blocked: bsig page b holds all pm
+//   slices for data pages b*bm .. b*bm+bm-1, so one bsig page
+//   read gives every slice a query needs for bm data pages
+// Slices are packed at bit granularity from the start of the
+//   page's items: bit j of slice i is bit i*bm + j, and says
+//   whether bit i is set in the psig of data page b*bm + j
+
+// set the bit-slice parameters for the blocked layout from
+//   the psig width p->pm
+// - bm, the slice width (data pages per bsig page), is what is
+//   left of a page shared between pm slices, capped at maxbm
+//   if maxbm > 0 (smaller blocks give finer-grained reads)
+// - bsigSize is bm in bytes, rounded up (only for display)
+// returns -1 if pm slices do not fit in a page
+
+Status setBsigParams(RelnParams *p, Count maxbm)
+{
+	Count available = (PAGESIZE-sizeof(Count));
+	Count bm = available*8 / p->pm;
+	if (bm < 1) return -1;
+	if (maxbm > 0 && maxbm < bm) bm = maxbm;
+	p->bsigPP = p->pm; p->bm = bm; p->bsigSize = iceil(bm, 8);
+	return 0;
+}
+
+// up to 64 bits of a slice, starting at bit off of b (LSB first)
+
+static uint64_t loadBits(Byte *b, size_t off, Count n)
+{
+	Byte *p = b + off/8;
+	int s = off%8;
+	Count nbytes = iceil(s + n, 8);
+	uint64_t w = 0;
+	for (int k = 0; k < nbytes && k < 8; k++)
+		w |= (uint64_t)p[k] << (8*k);
+	w >>= s;
+	if (nbytes > 8)
+		w |= (uint64_t)p[8] << (64 - s);
+	if (n < 64)
+		w &= ((uint64_t)1 << n) - 1;
+	return w;
+}
+
+// OR the low n (<= 64) bits of w into b, starting at bit off
+
+static void orBits64(Byte *b, size_t off, Count n, uint64_t w)
+{
+	if (n < 64)
+		w &= ((uint64_t)1 << n) - 1;
+	Byte *p = b + off/8;
+	int s = off%8;
+	Count nbytes = iceil(s + n, 8);
+	for (int k = 0; k < nbytes && k < 8; k++)
+		p[k] |= (w << s) >> (8*k);
+	if (nbytes > 8)
+		p[8] |= w >> (64 - s);
+}
+
+// an empty page of the .bsig file: pm slices, all zeroes
+
+Page newBsigPage(Reln r)
+{
+	Page p = newPage();
+	for (int i = 0; i < r->params.pm; i++)
+		addOneItem(p);
+	return p;
+}
+
+// add the psig of data page dpid to the bit-slices
+// - it only touches the bsig page for dpid's block, which is
+//   added if dpid starts a new block
+
+void addToBitSlices(Reln r, PageID dpid, Bits psig)
+{
+	RelnParams *rp = &(r->params);
+	PageID bpid = dpid / rp->bm;
+	Offset bit = dpid % rp->bm;
+	Page p;
+	if (bpid == rp->bsigNpages) {
+		addPage(r->bsigf);
+		rp->bsigNpages++;
+		p = newBsigPage(r);
+	}
+	else
+		p = getPage(r->bsigf, bpid);
+	Byte *slices = addrInPage(p, 0, 1);
+	for (int i = 0; i < rp->pm; i++) {
+		if (bitIsSet(psig, i))
+			orBits64(slices, (size_t)i*rp->bm + bit, 1, 1);
+	}
+	putPage(r->bsigf, bpid, p);
+}
+
+// find "matching" pages using bit-slices
+// - each bsig page is read once, and the slices for the
+//   query's 1-bits are ANDed, 64 data pages at a time, while
+//   the page is in memory; pages read grows with the
+//   relation, not the query weight
 
 void findPagesUsingBitSlices(Query q)
 {
 	assert(q != NULL);
 	//TODO
 	// init, AllZeroBits for pages
-	// unsetAllBits(q->pages); 
-	// q->nsigpages = 0;
-	// q->nsigs = 0;
+	unsetAllBits(q->pages); 
+	q->nsigpages = 0;
+	q->nsigs = 0;
 	
 	// we need to get the psig of query, and then compare it with all bsig
 	Reln r = q->rel;
 	Tuple qrt = q->qstring;
 	Bits query_sig = makePageSig(r,qrt);
-	// showBits(query_sig);
-	// printf("\n");
-	setAllBits(q->pages);
-	// we need to get the psig from file
 	File bsig_pages = bsigFile(r);
-	// Count psigNpages = nPsigPages(r); //  number of page signatures (psigs)
-	
-	Count bm = bsigBits(r); // bm == npages
-	Count pm = psigBits(r); //width of page sig
-	Count bsigPP = maxBsigsPP(r);
+	Count bm = bsigBits(r); // data pages per bsig page
+	Count pm = psigBits(r); // width of page sig == slices per bsig page
+	Count npages = nPages(r);
+	Count nwords = iceil(bm, 64);
 	
-	PageID pid = -1;
+	Page curr = arenaAlloc(q->mem, PAGESIZE);
+	uint64_t *matches = arenaAlloc(q->mem, nwords*sizeof(uint64_t));
+	assert(curr != NULL && matches != NULL);
 	
-	// iterate; exclusion; similar with human's method, find vertically
-	// 1. find ones in qsig; 
-	// 2. for every one in qsig, find corresponding bit slices (pid & position), which is rotated
-	// 3. in that bit slice, find which are not one, and exclude that page.
-	for (int ith = 0; ith < pm; ith++) {
-		if (bitIsSet(query_sig,ith)){
-			// check if in same bsig page
-			int pth = ith / maxBsigsPP(r);
-			if (pth != pid) {
-				q->nsigpages++;
-				pid = pth;
-			}
-			q->curpage = ith / bsigPP;
-			Page curr = getPage(bsig_pages, q->curpage); // (File f, PageID pid)
-			Bits curr_sig = newBits(bm);
-			q->curtup = ith % bsigPP;
-			getBits(curr, q->curtup, curr_sig);
-			for (int pth = 0; pth < (nPages(r)); pth++){
-				if(!bitIsSet(curr_sig, pth)){
-					unsetBit(q->pages, pth);
-				}
+	for (q->curpage = 0; q->curpage < nBsigPages(r); q->curpage++) {
+		readPage(bsig_pages, q->curpage, curr);
+		q->nsigpages++;
+		Byte *slices = addrInPage(curr, 0, 1);
+		// 1. start with every data page in this block
+		// 2. AND in the slice for each 1-bit in the query sig
+		for (Count w = 0; w < nwords; w++)
+			matches[w] = ~(uint64_t)0;
+		for (q->curtup = 0; q->curtup < pm; q->curtup++) {
+			if (!bitIsSet(query_sig, q->curtup)) continue;
+			size_t off = (size_t)q->curtup*bm;
+			uint64_t any = 0;
+			for (Count w = 0; w < nwords; w++) {
+				Count n = (bm - 64*w < 64) ? bm - 64*w : 64;
+				matches[w] &= loadBits(slices, off + 64*w, n);
+				any |= matches[w];
 			}
 			q->nsigs++;
-			free(curr);
+			if (any == 0) break; // nothing left in this block
+		}
+		// 3. what is left are the candidate data pages
+		PageID first = q->curpage*bm;
+		for (Offset j = 0; j < bm && first+j < npages; j++) {
+			if ((matches[j/64] >> (j%64)) & 1)
+				setBit(q->pages, first+j);
+		}
+	}
+	freeBits(query_sig);
+}
+
+// transpose a 64x64 bit matrix in place
+// bit c of a[r] ends up as bit r of a[c]
+// (recursive block swap: 32x32 blocks, then 16x16, ... 1x1)
+
+static void transpose64(uint64_t a[64])
+{
+	uint64_t m = 0x00000000FFFFFFFFULL;
+	for (int j = 32; j != 0; j >>= 1, m ^= (m << j)) {
+		for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+			uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+			a[k | j] ^= t;
+			a[k] ^= (t << j);
 		}
 	}
-	// showBits(q->pages);
-	// printf("\n");
-	free(query_sig);
 }
 
+// up to 8 bytes of a bit-string as one word (LSB in byte 0)
+
+static uint64_t loadWord(Byte *b, Count n)
+{
+	uint64_t w = 0;
+	for (int k = 0; k < n && k < 8; k++)
+		w |= (uint64_t)b[k] << (8*k);
+	return w;
+}
+
+// rebuild the whole .bsig file from the .psig file
+// - the psigs for one bsig page's bm data pages are read as a
+//   block (they are contiguous in the .psig file), transposed
+//   64x64 bits at a time into the pm slices, and the finished
+//   bsig page is written out; the file is written sequentially
+// - for recovery, or for relations with an older .bsig layout,
+//   so the layout parameters are worked out afresh first
+// - cached query results are dropped, as 'b' entries came
+//   from the old slices
+// returns -1 (leaving the .bsig file alone) if pm slices do
+//   not fit in a page
+
+Status rebuildBitSlices(Reln r)
+{
+	RelnParams *rp = &(r->params);
+	if (setBsigParams(rp, rp->bm) < 0) return -1;
+	Count pm = rp->pm, bm = rp->bm;
+	Count psigSize = rp->psigSize;
+	Count psigPP = rp->psigPP;
+	Count npages = rp->npages;
+	Count nblocks = iceil(npages, bm);
+	Byte *rows = malloc((size_t)bm*psigSize); // psigs of one block
+	assert(rows != NULL);
+	Page ppage = newPage(); // psig page being read
+	PageID ppid = NO_PAGE;
+	uint64_t a[64];
+
+	int ok = ftruncate(r->bsigf, 0);
+	assert(ok == 0);
+	posix_fadvise(r->psigf, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (PageID b = 0; b < nblocks; b++) {
+		// gather the psigs for data pages b*bm .. b*bm+n-1
+		PageID first = b*bm;
+		Count n = (npages - first < bm) ? npages - first : bm;
+		memset(rows, 0, (size_t)bm*psigSize);
+		for (Count j = 0; j < n; j++) {
+			PageID dpid = first + j;
+			if (dpid / psigPP != ppid) {
+				ppid = dpid / psigPP;
+				readPage(r->psigf, ppid, ppage);
+			}
+			if (dpid % psigPP < pageNitems(ppage))
+				memcpy(&rows[(size_t)j*psigSize],
+				       addrInPage(ppage, dpid % psigPP, psigSize), psigSize);
+		}
+		// transpose rows (data pages) x cols (psig bits) into
+		// slices, one 64x64 tile at a time
+		Page out = newBsigPage(r);
+		Byte *slices = addrInPage(out, 0, 1);
+		for (Count j0 = 0; j0 < n; j0 += 64) {
+			Count w = (n - j0 < 64) ? n - j0 : 64;
+			for (Count i0 = 0; i0 < pm; i0 += 64) {
+				for (int k = 0; k < 64; k++)
+					a[k] = (j0+k < n)
+					     ? loadWord(&rows[(size_t)(j0+k)*psigSize + i0/8],
+					                psigSize - i0/8)
+					     : 0;
+				transpose64(a);
+				for (int k = 0; k < 64 && i0+k < pm; k++)
+					orBits64(slices, (size_t)(i0+k)*bm + j0, w, a[k]);
+			}
+		}
+		putPage(r->bsigf, b, out);
+	}
+	rp->bsigNpages = nblocks;
+	rp->nbsigs = pm;
+	free(ppage);
+	free(rows);
+	clearQueryCache(r);
+	return 0;
+}
@@ -4,10 +4,14 @@
 // Written by John Shepherd, March 2019
 
 #include <unistd.h>
+#include <fcntl.h>
 #include "defs.h"
 #include "page.h"
 #include "reln.h"
 
+// most Pages fetched by one getPageRun()
+#define SCANRUN 64
+
 // internal representation of pages
 struct _PageRep {
 	Count nitems;  // #items in this page
@@ -38,6 +42,7 @@ void addPage(File f)
 	Page p = newPage();
 	int n = write(f, p, PAGESIZE);
 	assert(n == PAGESIZE);
+	free(p);
 }
 
 // fetch a Page from a file
@@ -45,15 +50,62 @@ void addPage(File f)
 
 Page getPage(File f, PageID pid)
 {
-	//fprintf(stderr,"getPage(%d)\n",pid);
-	assert(pid >= 0);
 	Page p = malloc(PAGESIZE);
 	assert(p != NULL);
+	readPage(f, pid, p);
+	return p;
+}
+
+// fetch a Page from a file into an existing buffer
+// lets scans re-use one buffer (e.g. from a query's Arena)
+
+void readPage(File f, PageID pid, Page p)
+{
+	//fprintf(stderr,"readPage(%d)\n",pid);
+	assert(pid >= 0 && p != NULL);
 	int ok = lseek(f, pid*PAGESIZE, SEEK_SET);
 	assert(ok >= 0);
 	int n = read(f, p, PAGESIZE);
 	assert(n == PAGESIZE);
-	return p;
+}
+
+// fetch up to *n consecutive Pages from a file with a single read
+// at most SCANRUN Pages are read; *n is set to the number read
+// store them in one newly-allocated buffer (use pageInRun())
+// the run after this one is requested in the background,
+//   so it is loading while this one is being processed
+
+Page getPageRun(File f, PageID pid, Count *n)
+{
+	assert(pid >= 0 && n != NULL && *n > 0);
+	if (*n > SCANRUN) *n = SCANRUN;
+	Count np = *n;
+	Page run = malloc((size_t)np*PAGESIZE);
+	assert(run != NULL);
+	int ok = lseek(f, (off_t)pid*PAGESIZE, SEEK_SET);
+	assert(ok >= 0);
+	ssize_t nread = read(f, run, (size_t)np*PAGESIZE);
+	assert(nread == (ssize_t)np*PAGESIZE);
+	posix_fadvise(f, (off_t)(pid+np)*PAGESIZE, (off_t)np*PAGESIZE,
+	              POSIX_FADV_WILLNEED);
+	return run;
+}
+
+// i'th Page in a buffer returned by getPageRun()
+
+Page pageInRun(Page run, Count i)
+{
+	return (Page)((Byte *)run + (size_t)i*PAGESIZE);
+}
+
+// tell the kernel we will soon read a Page from a file
+// - returns immediately; the read happens in the background
+// - later getPage() for that page should find it cached
+
+void prefetchPage(File f, PageID pid)
+{
+	assert(pid >= 0);
+	posix_fadvise(f, (off_t)pid*PAGESIZE, PAGESIZE, POSIX_FADV_WILLNEED);
 }
 
 // write a Page to a file; release allocated buffer
@@ -0,0 +1,252 @@
+// part.c ... functions on Partitioned Relations
+// part of signature indexed files
+// A partitioned relation R is a small file R.part holding
+//   PartParams, plus one ordinary relation R-0, R-1, ...
+//   per partition, each with its own data and signature files
+// Tuples are placed by hashing one chosen attribute, so a
+//   query that binds that attribute touches one partition,
+//   and each partition's bsigs only cover its own pages
+// Partitions that a query's psig rules out (see reln.c for
+//   summaries) are not searched at all
+// Partitions are searched in parallel threads, so programs
+//   using these functions must be linked with -lpthread
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "defs.h"
+#include "part.h"
+#include "reln.h"
+#include "query.h"
+#include "tuple.h"
+#include "bits.h"
+#include "psig.h"
+#include "hash.h"
+
+// name of the relation holding partition i
+
+static void partName(char *buf, char *name, int i)
+{
+	snprintf(buf, MAXFILENAME, "%s-%d", name, i);
+}
+
+// which partition a value of the partitioning attribute goes in
+
+static int partOf(PartReln pr, char *val)
+{
+	return hash_any(val, strlen(val)) % pr->params.nparts;
+}
+
+// create a new partitioned relation
+// every partition gets the same relation parameters
+
+Status newPartRelation(char *name, int nparts, int attr,
+                       Count nattrs, float pF, char sigtype,
+                       Count tk, Count tm, Count pm, Count bm)
+{
+	// checked as signed values, so a negative argument is rejected
+	if (nparts < 1 || nparts > MAXPARTS) return -1;
+	if (attr < 0 || attr >= (int)nattrs) return -1;
+	char pname[MAXFILENAME];
+	for (int i = 0; i < nparts; i++) {
+		partName(pname, name, i);
+		if (newRelation(pname, nattrs, pF, sigtype, tk, tm, pm, bm) < 0)
+			return -1;
+	}
+	PartParams params = { nparts, attr };
+	File f = openFile(name, "part");
+	int n = write(f, &params, sizeof(PartParams));
+	assert(n == sizeof(PartParams));
+	close(f);
+	return 0;
+}
+
+// check whether a partitioned relation already exists
+
+Bool existsPartRelation(char *name)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.part",name);
+	File f = open(fname,O_RDONLY);
+	if (f < 0)
+		return FALSE;
+	else {
+		close(f);
+		return TRUE;
+	}
+}
+
+// open the R.part file and every partition
+
+PartReln openPartRelation(char *name)
+{
+	PartReln pr = malloc(sizeof(PartRelnRep));
+	assert(pr != NULL);
+	File f = openFile(name, "part");
+	int n = read(f, &(pr->params), sizeof(PartParams));
+	assert(n == sizeof(PartParams));
+	close(f);
+	char pname[MAXFILENAME];
+	for (int i = 0; i < pr->params.nparts; i++) {
+		partName(pname, name, i);
+		pr->parts[i] = openRelation(pname);
+	}
+	return pr;
+}
+
+// close every partition; R.part never changes after creation
+
+void closePartRelation(PartReln pr)
+{
+	for (int i = 0; i < pr->params.nparts; i++)
+		closeRelation(pr->parts[i]);
+	free(pr);
+}
+
+// insert a tuple into the partition its attribute value hashes to
+// returns page where inserted within that partition
+
+PageID addToPartRelation(PartReln pr, Tuple t)
+{
+	Reln r = pr->parts[0];
+	char **vals = tupleVals(r, t);
+	int i = partOf(pr, vals[pr->params.attr]);
+	freeVals(vals, nAttrs(r));
+	return addToRelation(pr->parts[i], t);
+}
+
+// check a query against a partition's relation-wide summary
+
+static Bool partCanMatch(Reln r, char *q)
+{
+	Bits qsig = makePageSig(r, q);
+	Bool ok = isSubset(qsig, r->summary);
+	freeBits(qsig);
+	return ok;
+}
+
+// signature selection for one partition, run in its own thread
+
+typedef struct {
+	Reln rel;
+	char *qstring;
+	char sigs;
+	Query result;
+} PartJob;
+
+static void *runPartQuery(void *arg)
+{
+	PartJob *job = arg;
+	job->result = startQuery(job->rel, job->qstring, job->sigs);
+	return NULL;
+}
+
+// start a query over a partitioned relation
+// - if the query binds the partitioning attribute, only the
+//   partition that value hashes to can hold answers
+// - partitions whose summary signature does not cover the
+//   query's psig are skipped too
+// - signature selection for the remaining partitions runs
+//   concurrently, one thread per partition
+// - tupleVals() may split its string in place, so every
+//   partition's query gets its own copy of q, and pruning
+//   (which reads q) is finished before any thread starts
+// - returns NULL if the query is not valid for the relation,
+//   or if any partition that has to be searched could not
+//   start it (too big for QUERYMEM; see startQuery()), since
+//   leaving that partition out would silently lose answers
+
+PartQuery startPartQuery(PartReln pr, char *q, char sigs)
+{
+	Count nparts = pr->params.nparts;
+	if (!checkQuery(pr->parts[0], q))
+		return NULL;
+	PartQuery pq = malloc(sizeof(PartQueryRep));
+	assert(pq != NULL);
+	pq->prel = pr;
+
+	int only = -1; // the one partition to search, if pruned
+	char **vals = tupleVals(pr->parts[0], q);
+	if (strcmp(vals[pr->params.attr], "?") != 0)
+		only = partOf(pr, vals[pr->params.attr]);
+	freeVals(vals, nAttrs(pr->parts[0]));
+
+	PartJob jobs[MAXPARTS];
+	pthread_t tids[MAXPARTS];
+	Bool started[MAXPARTS];
+	for (int i = 0; i < nparts; i++) {
+		pq->qstrings[i] = NULL;
+		jobs[i] = (PartJob){ pr->parts[i], NULL, sigs, NULL };
+		started[i] = FALSE;
+		if (only >= 0 && i != only) continue;
+		// skip partitions whose summary rules the query out
+		if (!partCanMatch(pr->parts[i], q)) continue;
+		pq->qstrings[i] = jobs[i].qstring = strdup(q);
+		assert(jobs[i].qstring != NULL);
+	}
+	for (int i = 0; i < nparts; i++) {
+		if (jobs[i].qstring == NULL) continue;
+		if (pthread_create(&tids[i], NULL, runPartQuery, &jobs[i]) == 0)
+			started[i] = TRUE;
+		else
+			runPartQuery(&jobs[i]); // no thread; do it here
+	}
+	Bool failed = FALSE;
+	for (int i = 0; i < nparts; i++) {
+		if (started[i]) pthread_join(tids[i], NULL);
+		pq->queries[i] = jobs[i].result;
+		if (jobs[i].qstring != NULL && jobs[i].result == NULL)
+			failed = TRUE;
+	}
+	if (failed) {
+		closePartQuery(pq);
+		return NULL;
+	}
+	return pq;
+}
+
+// show matching tuples, partition by partition
+
+void scanAndDisplayPartMatchingTuples(PartQuery pq)
+{
+	for (int i = 0; i < pq->prel->params.nparts; i++) {
+		if (pq->queries[i] != NULL)
+			scanAndDisplayMatchingTuples(pq->queries[i]);
+	}
+}
+
+// print statistics summed over all partitions
+
+void partQueryStats(PartQuery pq)
+{
+	Count searched = 0;
+	Count nsigpages = 0, nsigs = 0, ntuppages = 0, ntuples = 0, nfalse = 0;
+	for (int i = 0; i < pq->prel->params.nparts; i++) {
+		Query q = pq->queries[i];
+		if (q == NULL) continue;
+		searched++;
+		nsigpages += q->nsigpages; nsigs += q->nsigs;
+		ntuppages += q->ntuppages; ntuples += q->ntuples;
+		nfalse += q->nfalse;
+	}
+	printf("# partitions searched: %d of %d\n",
+	       searched, pq->prel->params.nparts);
+	printf("# sig pages read:    %d\n", nsigpages);
+	printf("# signatures read:   %d\n", nsigs);
+	printf("# data pages read:   %d\n", ntuppages);
+	printf("# tuples examined:   %d\n", ntuples);
+	printf("# false match pages: %d\n", nfalse);
+}
+
+// clean up a PartQueryRep and the per-partition queries
+
+void closePartQuery(PartQuery pq)
+{
+	for (int i = 0; i < pq->prel->params.nparts; i++) {
+		if (pq->queries[i] != NULL)
+			closeQuery(pq->queries[i]);
+		free(pq->qstrings[i]);
+	}
+	free(pq);
+}
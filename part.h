@@ -0,0 +1,47 @@
+// part.h ... interface to functions on Partitioned Relations
+// part of signature indexed files
+// See part.c for details on functions
+
+#ifndef PART_H
+#define PART_H 1
+
+#include "defs.h"
+#include "reln.h"
+#include "query.h"
+
+#define MAXPARTS 64
+
+typedef struct _PartParams {
+	Count nparts;  // number of partitions
+	int attr;      // attribute whose hash picks the partition
+} PartParams;
+
+typedef struct _PartRelnRep {
+	PartParams params;
+	Reln parts[MAXPARTS]; // each partition is an ordinary relation
+} PartRelnRep;
+
+typedef struct _PartRelnRep *PartReln;
+
+typedef struct _PartQueryRep {
+	PartReln prel;
+	Query queries[MAXPARTS]; // NULL only for partitions pruned away
+	char *qstrings[MAXPARTS]; // each query's own copy of the text
+} PartQueryRep;
+
+typedef struct _PartQueryRep *PartQuery;
+
+Status newPartRelation(char *name, int nparts, int attr,
+                       Count nattrs, float pF, char sigtype,
+                       Count tk, Count tm, Count pm, Count bm);
+Bool existsPartRelation(char *name);
+PartReln openPartRelation(char *name);
+void closePartRelation(PartReln pr);
+PageID addToPartRelation(PartReln pr, Tuple t);
+
+PartQuery startPartQuery(PartReln pr, char *q, char sigs);
+void scanAndDisplayPartMatchingTuples(PartQuery pq);
+void partQueryStats(PartQuery pq);
+void closePartQuery(PartQuery pq);
+
+#endif
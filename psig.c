@@ -7,6 +7,8 @@
 #include "query.h"
 #include "psig.h"
 #include "hash.h"
+#include "tuple.h"
+#include "arena.h"
 
 // The srandom() function sets its argument as the seed for a new sequence of pseudo-random integers to be 
 // returned by random(). These sequences are repeatable by calling srandom() with the same seed value. If no 
@@ -14,42 +16,68 @@
 
 // NB: Bits more than one byte, we cannot simply use |=
 
+// SIMC codeword: tk bits set anywhere in the page signature
+
 Bits codeword(char *attr_value, Reln r) {
-	Count pm = psigBits(r);// width of page signature (#bits)
-	Count tk = codeBits(r);// bits set per attribute
-	int counter = 0;
-	Bits cw = newBits(pm);
-	srandom(hash_any(attr_value, strlen(attr_value)));  // seed
-	while (counter < tk) {
-		int i = random() % pm;    // random # from 0 to pm-1
-		if (!bitIsSet(cw,i)){       // check if set to 1
-			setBit(cw,i);
-			counter++;
-		}   
-	}
-	return cw; // m-bits with k 1-bits and m-k 0-bits
+	return relnCodeword(r, attr_value, psigBits(r), 0, psigBits(r), codeBits(r));
 }
 
 Bits makePageSig(Reln r, Tuple t)
 {
 	assert(r != NULL && t != NULL);
 	//TODO
-	// SIMC
 	Bits desc = newBits(psigBits(r));
 	char **A = tupleVals(r, t);// extract values into an array of strings
 	Count n = nAttrs(r);// number of attributes
 	// desc(t) = cw(A1) OR cw(A2) OR ... OR cw(An)
 	// maybe not all n attributes are used in descriptor, say (Perryridge, ?, ?, ?)
+	// CATC: each attribute sets bits only in its own region
 	for (int i = 0; i < n; i++) {
 		// return 0 if same; 0 is false in our case
 		if (strcmp(A[i],"?")){
-			Bits cw = codeword(A[i], r); // get codeword for each attribute
+			Bits cw; // get codeword for each attribute
+			if (sigType(r) == 'c')
+				cw = catcCodeword(r, psigBits(r), maxTupsPP(r), i, A[i]);
+			else
+				cw = codeword(A[i], r);
 			orBits(desc,cw);
+			freeBits(cw);
 		}
 	}
+	freeVals(A, n);
 	return desc;
 }
 
+// test every psig on one psig page (page ppid of the .psig file)
+// psig i on that page describes data page ppid*psigPP + i
+
+static void matchPsigPage(Query q, Page curr, PageID ppid,
+                          Bits query_sig, Bits curr_sig)
+{
+	Count psigPP = maxPsigsPP(q->rel);
+	Count npitem = pageNitems(curr); // number of items in this page
+	q->curpage = ppid;
+	for (q->curtup = 0; q->curtup < npitem; q->curtup++) {
+		// (Byte *)(&(p->items[0]) + size*off); so no need to consider nitems in the memory
+		// get nth item in the page, and put in curr_sig
+		getBits(curr, q->curtup, curr_sig); 
+		if (isSubset(query_sig, curr_sig)){
+			// include PID in Pages
+			// first page is zero
+			setBit(q->pages, ppid*psigPP + q->curtup);
+		}
+		q->nsigs++;
+	}
+	q->nsigpages++;
+}
+
+// find "matching" pages using page signatures
+// - descend from the summaries in the .ssig file: only psig
+//   pages whose summary covers the query psig are read
+// - consecutive psig pages that need reading are fetched
+//   a run at a time (see getPageRun())
+// - startQuery() has already checked the relation-wide summary
+
 void findPagesUsingPageSigs(Query q)
 {
 	assert(q != NULL);
@@ -68,32 +96,39 @@ void findPagesUsingPageSigs(Query q)
 	File psig_pages = psigFile(r);
 	Count psigNpages = nPsigPages(r); //  number of page signatures (psigs)
 	Count pm = psigBits(r); // width of psig
+	Count psigPP = maxPsigsPP(r);
+	Count nspages = iceil(psigNpages, psigPP); // number of summary pages
 	
-	// iterate all items in each page
-	for (q->curpage = 0; q->curpage < psigNpages; q->curpage++) {
-		Page curr = getPage(psig_pages, q->curpage); // (File f, PageID pid) => Page
-		Count npitem = pageNitems(curr); // number of items in this page
-		for (q->curtup = 0; q->curtup < npitem; q->curtup++) {
-			Bits curr_sig = newBits(pm);
-			// unsetAllBits(curr_sig); seems no need to do this
-			// (Byte *)(&(p->items[0]) + size*off); so no need to consider nitems in the memory
-			// get nth item in the page, and put in curr_sig
-			getBits(curr, q->curtup, curr_sig); 
-			if (isSubset(query_sig, curr_sig)){
-				// include PID in Pages
-				// first page is zero
-				// showBits(query_sig);
-				// printf("\n");
-				// showBits(curr_sig);
-				// printf("\n");
-				setBit(q->pages, q->nsigs);
-				// printf("pid: %d\n",q->nsigs);
-			}
+	Bits curr_sig = newBitsIn(q->mem, pm);
+	Bits marks = newBitsIn(q->mem, psigPP); // psig pages under this summary page to read
+	Page sp = arenaAlloc(q->mem, PAGESIZE);
+	assert(sp != NULL);
+	for (PageID spid = 0; spid < nspages; spid++) {
+		readPage(r->ssigf, spid, sp);
+		Count nsum = pageNitems(sp);
+		unsetAllBits(marks);
+		for (Offset i = 0; i < nsum; i++) {
+			getBits(sp, i, curr_sig);
+			if (isSubset(query_sig, curr_sig))
+				setBit(marks, i);
 			q->nsigs++;
-			// printf("pid: %d\n",q->nsigs);
 		}
 		q->nsigpages++;
-		free(curr);
+		// read each run of consecutive marked psig pages
+		Offset i = 0;
+		while (i < nsum) {
+			if (!bitIsSet(marks, i)) { i++; continue; }
+			Offset j = i;
+			while (j < nsum && bitIsSet(marks, j)) j++;
+			PageID first = spid*psigPP + i;
+			Count n = j-i;
+			Page run = getPageRun(psig_pages, first, &n);
+			for (Offset k = 0; k < n; k++)
+				matchPsigPage(q, pageInRun(run, k), first+k, query_sig, curr_sig);
+			free(run);
+			i += n;
+		}
 	}
+	freeBits(query_sig);
 }
 
@@ -0,0 +1,268 @@
+// qcache.c ... query-result cache
+// part of signature indexed files
+// Each open relation has a table of recent query results:
+//   (query string, selection method, ntups, npages, q->pages)
+// A repeated query takes its candidate pages from its entry
+//   instead of scanning signatures
+// Entries stay valid as the relation grows: only what was
+//   added since the entry was made is re-tested, with the
+//   entry's own method, so a cached result is exactly what
+//   the method would give from scratch
+// - 'p' and 'b' re-test the data pages added (or appended
+//   to), against their page signatures
+// - 't' re-tests the tuples added, against their tuple
+//   signatures
+// - 'h' results are not cached: they include a per-tuple
+//   bitmap (q->tuples) that the cache does not hold, and
+//   without it every tuple on each candidate page is read
+// The table is direct-mapped: a query's slot is picked by
+//   hashing the query string and method, and a new entry
+//   replaces whatever was in its slot
+// The table is kept in memory while the relation is open. It
+//   is loaded from R.qcache with one read on first use, and
+//   written back by syncRelation() only if it has changed,
+//   so a query never touches R.qcache itself
+
+#include <unistd.h>
+#include "defs.h"
+#include "qcache.h"
+#include "reln.h"
+#include "query.h"
+#include "page.h"
+#include "bits.h"
+#include "psig.h"
+#include "tsig.h"
+#include "arena.h"
+#include "hash.h"
+
+// number of slots in the table
+#define QCACHESLOTS 256
+
+// header of one cache entry in R.qcache
+// followed by qlen bytes of query string,
+// then the candidate page bitmap (npages bits)
+typedef struct _CacheHdr {
+	Count qlen;    // length of query string (0 = empty slot)
+	Count npages;  // nPages(r) when the entry was made
+	Count ntups;   // nTuples(r) when the entry was made
+	char  sigs;    // selection method ('t', 'p', 'b', 'h')
+} CacheHdr;
+
+typedef struct _CacheEntry {
+	CacheHdr h;
+	char qstring[MAXTUPLEN+1];
+	Bits pages;    // candidate pages (h.npages bits)
+} CacheEntry;
+
+struct _QCacheRep {
+	Bool dirty;    // changed since R.qcache was written
+	CacheEntry slots[QCACHESLOTS];
+};
+
+// slot for query string q with method sigs
+
+static CacheEntry *cacheSlot(QCache c, char *q, char sigs)
+{
+	uint32_t h = hash_any(q, strlen(q)) + sigs;
+	return &(c->slots[h % QCACHESLOTS]);
+}
+
+// put an entry in its slot, replacing the old one
+
+static void storeEntry(QCache c, CacheHdr h, char *q, Bits pages)
+{
+	CacheEntry *e = cacheSlot(c, q, h.sigs);
+	if (e->h.qlen > 0) freeBits(e->pages);
+	e->h = h;
+	memcpy(e->qstring, q, h.qlen);
+	e->qstring[h.qlen] = '\0';
+	e->pages = pages;
+	c->dirty = TRUE;
+}
+
+// the relation's cache, loading it from R.qcache if need be
+// - R.qcache is a sequence of entries; where two share a
+//   slot, the later one wins
+
+static QCache relnCache(Reln r)
+{
+	if (r->qcache != NULL) return r->qcache;
+	QCache c = calloc(1, sizeof(struct _QCacheRep));
+	assert(c != NULL);
+	r->qcache = c;
+	off_t size = lseek(r->qcachef, 0, SEEK_END);
+	if (size <= 0) return c;
+	Byte *buf = malloc(size);
+	assert(buf != NULL);
+	lseek(r->qcachef, 0, SEEK_SET);
+	if (read(r->qcachef, buf, size) != size) size = 0;
+	off_t pos = 0;
+	while (pos + (off_t)sizeof(CacheHdr) <= size) {
+		CacheHdr h;
+		memcpy(&h, buf+pos, sizeof(CacheHdr));
+		pos += sizeof(CacheHdr);
+		if (h.qlen < 1 || h.qlen > MAXTUPLEN || h.npages < 0 ||
+		    pos + h.qlen + iceil(h.npages, 8) > size)
+			break;
+		char q[MAXTUPLEN+1];
+		memcpy(q, buf+pos, h.qlen);
+		q[h.qlen] = '\0';
+		pos += h.qlen;
+		Bits pages = newBits(h.npages);
+		for (PageID pid = 0; pid < h.npages; pid++) {
+			if (buf[pos + pid/8] & (1 << (pid%8)))
+				setBit(pages, pid);
+		}
+		pos += iceil(h.npages, 8);
+		if (h.sigs == 'h') {
+			freeBits(pages); // from before 'h' was left out
+			continue;
+		}
+		storeEntry(c, h, q, pages);
+	}
+	free(buf);
+	c->dirty = FALSE;
+	return c;
+}
+
+// copy q->pages into the cache as the result of this query
+
+static void cacheQuery(Query q, char sigs)
+{
+	Reln r = q->rel;
+	CacheHdr h = { strlen(q->qstring), nPages(r), nTuples(r), sigs };
+	if (h.qlen > MAXTUPLEN) return;
+	Bits pages = newBits(nPages(r));
+	orBits(pages, q->pages);
+	storeEntry(relnCache(r), h, q->qstring, pages);
+}
+
+// set q->pages for data pages from first onwards, using their psigs
+
+static void retestPages(Query q, PageID first)
+{
+	Reln r = q->rel;
+	Bits query_sig = makePageSig(r, q->qstring);
+	Bits curr_sig = newBitsIn(q->mem, psigBits(r));
+	Page curr = arenaAlloc(q->mem, PAGESIZE);
+	assert(curr != NULL);
+	Count psigPP = maxPsigsPP(r);
+	PageID currpid = NO_PAGE; // psig page held in curr
+	for (PageID pid = first; pid < nPages(r); pid++) {
+		if (pid / psigPP != currpid) {
+			currpid = pid / psigPP;
+			readPage(psigFile(r), currpid, curr);
+			q->nsigpages++;
+		}
+		getBits(curr, pid % psigPP, curr_sig);
+		q->nsigs++;
+		if (isSubset(query_sig, curr_sig))
+			setBit(q->pages, pid);
+	}
+	freeBits(query_sig);
+}
+
+// set q->pages for tuples from tid first onwards, using their tsigs
+// tsig i is for tuple i, which is on data page i/tupPP
+
+static void retestTuples(Query q, Count first)
+{
+	Reln r = q->rel;
+	Bits query_sig = makeTupleSig(r, q->qstring);
+	Bits curr_sig = newBitsIn(q->mem, tsigBits(r));
+	Page curr = arenaAlloc(q->mem, PAGESIZE);
+	assert(curr != NULL);
+	Count tsigPP = maxTsigsPP(r);
+	PageID currpid = NO_PAGE; // tsig page held in curr
+	for (Count tid = first; tid < nTuples(r); tid++) {
+		if (tid / tsigPP != currpid) {
+			currpid = tid / tsigPP;
+			readPage(tsigFile(r), currpid, curr);
+			q->nsigpages++;
+		}
+		getBits(curr, tid % tsigPP, curr_sig);
+		q->nsigs++;
+		if (isSubset(query_sig, curr_sig))
+			setBit(q->pages, tid / maxTupsPP(r));
+	}
+	freeBits(query_sig);
+}
+
+// set q->pages from the cache, if this query has been run before
+// - anything added since the entry was made is re-tested
+//   with the entry's own method, and the entry is refreshed
+// - returns FALSE (q->pages untouched) if there is no entry
+
+Bool getCachedPages(Query q, char sigs)
+{
+	Reln r = q->rel;
+	if (sigs == 'h') return FALSE;
+	CacheEntry *e = cacheSlot(relnCache(r), q->qstring, sigs);
+	CacheHdr h = e->h;
+	if (h.qlen == 0 || h.sigs != sigs || strcmp(e->qstring, q->qstring) != 0 ||
+	    h.npages > nPages(r) || h.ntups > nTuples(r))
+		return FALSE;
+	for (PageID pid = 0; pid < h.npages; pid++) {
+		if (bitIsSet(e->pages, pid)) setBit(q->pages, pid);
+	}
+	if (h.ntups == nTuples(r)) return TRUE;
+	if (sigs == 't')
+		retestTuples(q, h.ntups);
+	else
+		retestPages(q, h.npages-1);
+	cacheQuery(q, sigs);
+	return TRUE;
+}
+
+// record q->pages as the result of this query
+
+void putCachedPages(Query q, char sigs)
+{
+	if (sigs == 'h') return;
+	cacheQuery(q, sigs);
+}
+
+// write the cache back to R.qcache, if it has changed
+
+void syncQueryCache(Reln r)
+{
+	QCache c = r->qcache;
+	if (c == NULL || !c->dirty) return;
+	int ok = ftruncate(r->qcachef, 0);
+	assert(ok == 0);
+	lseek(r->qcachef, 0, SEEK_SET);
+	for (int i = 0; i < QCACHESLOTS; i++) {
+		CacheEntry *e = &(c->slots[i]);
+		if (e->h.qlen == 0) continue;
+		int n = write(r->qcachef, &(e->h), sizeof(CacheHdr));
+		assert(n == sizeof(CacheHdr));
+		n = write(r->qcachef, e->qstring, e->h.qlen);
+		assert(n == e->h.qlen);
+		writeBits(r->qcachef, e->pages);
+	}
+	c->dirty = FALSE;
+}
+
+// drop every cached result, in memory and in R.qcache
+// - needed whenever signatures are rebuilt, since cached
+//   pages came from the old signatures
+
+void clearQueryCache(Reln r)
+{
+	freeQueryCache(r);
+	int ok = ftruncate(r->qcachef, 0);
+	assert(ok == 0);
+}
+
+// release the in-memory cache (without writing it back)
+
+void freeQueryCache(Reln r)
+{
+	QCache c = r->qcache;
+	if (c == NULL) return;
+	for (int i = 0; i < QCACHESLOTS; i++) {
+		if (c->slots[i].h.qlen > 0) freeBits(c->slots[i].pages);
+	}
+	free(c);
+	r->qcache = NULL;
+}
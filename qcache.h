@@ -0,0 +1,19 @@
+// qcache.h ... interface to the query-result cache
+// part of signature indexed files
+// See qcache.c for details on functions
+
+#ifndef QCACHE_H
+#define QCACHE_H 1
+
+#include "defs.h"
+#include "query.h"
+
+typedef struct _QCacheRep *QCache;
+
+Bool getCachedPages(Query q, char sigs);
+void putCachedPages(Query q, char sigs);
+void syncQueryCache(Reln r);
+void clearQueryCache(Reln r);
+void freeQueryCache(Reln r);
+
+#endif
@@ -5,12 +5,32 @@
 
 #include "defs.h"
 #include "query.h"
+#include "page.h"
 #include "reln.h"
 #include "tuple.h"
 #include "bits.h"
 #include "tsig.h"
 #include "psig.h"
 #include "bsig.h"
+#include "arena.h"
+#include "qcache.h"
+
+// how many candidate data pages to request ahead of the scan
+#define PREFETCH 16
+
+// most memory one query may allocate from its Arena
+#define QUERYMEM (64*1024*1024)
+
+// room allowed in QUERYMEM for the way an Arena maps memory
+// - an allocation bigger than a block gets a block of its own,
+//   rounded up to a whole number of 2MB blocks; a query has at
+//   most three of those (page bitmaps, and the tuple bitmap
+//   for 'h')
+// - everything else is small, and fits in one more block
+#define QUERYSLACK (8*1024*1024)
+
+// upper bound on the Arena bytes taken by a Bits of n bits
+#define BITSMEM(n) ((size_t)(n)/8 + 2*sizeof(Count) + 32)
 
 // check whether a query is valid for a relation
 // e.g. same number of attributes
@@ -27,44 +47,210 @@ int checkQuery(Reln r, char *q)
 	return (nattr == nAttrs(r));
 }
 
-// take a query string (e.g. "1234,?,abc,?")
-// set up a QueryRep object for the scan
+// split the query string once, before any pages are scanned
+// - qvals[i] is the value for attribute i ("?" if unbound)
+// - qlens[i] is its length, so matching never calls strlen()
+// - lastbound is the highest bound attribute (-1 if none),
+//   so verification can stop reading a tuple after it
 
-Query startQuery(Reln r, char *q, char sigs)
+static void compileQuery(Query q)
+{
+	Reln r = q->rel;
+	Count n = nAttrs(r);
+	q->qvals = tupleVals(r, q->qstring);
+	q->qlens = arenaAlloc(q->mem, n*sizeof(Count));
+	assert(q->qlens != NULL);
+	q->lastbound = -1;
+	for (int i = 0; i < n; i++) {
+		q->qlens[i] = strlen(q->qvals[i]);
+		if (strcmp(q->qvals[i],"?") != 0)
+			q->lastbound = i;
+	}
+	// per-slot scratch for matchPageTuples(); allocated once per query
+	q->hits = newBitsIn(q->mem, maxTupsPP(r));
+	q->cursor = arenaAlloc(q->mem, maxTupsPP(r)*sizeof(char *));
+	assert(q->cursor != NULL);
+}
+
+// most Arena memory a query with method sigs can need
+// - bitmaps over every data page (and over every tuple, for
+//   'h'), per-tuple-slot scratch, a few signatures and a few
+//   page buffers; see the users of q->mem
+
+static size_t queryMemory(Reln r, char sigs)
+{
+	Count widest = psigBits(r);
+	if (tsigBits(r) > widest) widest = tsigBits(r);
+	if (bsigBits(r) > widest) widest = bsigBits(r);
+	if (maxPsigsPP(r) > widest) widest = maxPsigsPP(r);
+	size_t need = 2*BITSMEM(nPages(r)) + 4*BITSMEM(widest)
+	            + BITSMEM(maxTupsPP(r)) + maxTupsPP(r)*sizeof(char *)
+	            + nAttrs(r)*sizeof(Count) + 4*PAGESIZE + 256;
+	if (sigs == 'h')
+		need += BITSMEM((size_t)nPages(r)*maxTupsPP(r));
+	return need;
+}
+
+// an empty Arena for a new query on r
+// - re-uses one that an earlier query on r has released
+// - a relation is only used by one thread at a time (part.c
+//   gives each thread its own partition), so no locking
+
+static Arena takeArena(Reln r)
+{
+	if (r->narenas > 0)
+		return r->arenas[--r->narenas];
+	return newArena(QUERYMEM);
+}
+
+// give a closed query's Arena back to its relation
+// closeRelation() frees the ones that are kept
+
+static void releaseArena(Reln r, Arena a)
+{
+	if (r->narenas == QUERYARENAS) {
+		freeArena(a);
+		return;
+	}
+	resetArena(a);
+	r->arenas[r->narenas++] = a;
+}
+
+// set up a QueryRep object with no pages selected yet
+// everything the query needs while it is open is allocated
+//   from its own Arena (q->mem) and released by closeQuery()
+// returns NULL if the query is invalid, or might need more
+//   than QUERYMEM bytes (use checkQuery() to tell which)
+// - the arena itself also refuses to map more than QUERYMEM
+
+static Query newQuery(Reln r, char *q, char sigs)
 {
+	if (!checkQuery(r, q) || queryMemory(r, sigs) + QUERYSLACK > QUERYMEM)
+		return NULL;
 	Query new = malloc(sizeof(QueryRep));
 	assert(new != NULL);
-	if (!checkQuery(r, q))
-		return NULL;
 	new->rel = r;
 	new->qstring = q;
 	new->nsigs = new->nsigpages = 0;
 	new->ntuples = new->ntuppages = new->nfalse = 0;
-	new->pages = newBits(nPages(r));
+	new->mem = takeArena(r);
+	new->pages = newBitsIn(new->mem, nPages(r));
+	new->tuples = NULL;
+	compileQuery(new);
+	new->curpage = 0;
+	return new;
+}
+
+// select candidate pages with one method, from scratch
+
+static void findPages(Query q, char sigs)
+{
 	switch (sigs)
 	{
 	case 't':
-		findPagesUsingTupSigs(new);
+		findPagesUsingTupSigs(q);
 		break;
 	case 'p':
-		findPagesUsingPageSigs(new);
+		findPagesUsingPageSigs(q);
 		break;
 	case 'b':
-		findPagesUsingBitSlices(new);
+		findPagesUsingBitSlices(q);
+		break;
+	case 'h':
+		findPagesUsingPageAndTupSigs(q);
 		break;
 	default:
-		setAllBits(new->pages);
+		setAllBits(q->pages);
 		break;
 	}
-	new->curpage = 0;
+	q->curpage = 0;
+}
+
+// take a query string (e.g. "1234,?,abc,?")
+// set up a QueryRep object for the scan
+
+Query startQuery(Reln r, char *q, char sigs)
+{
+	Query new = newQuery(r, q, sigs);
+	if (new == NULL)
+		return NULL;
+	Bool usesSigs = (sigs == 't' || sigs == 'p' || sigs == 'b' || sigs == 'h');
+	if (usesSigs) {
+		// a query whose psig is not covered by the relation-wide
+		// summary cannot match anything; skip the signature scan
+		Bits qsig = makePageSig(r, q);
+		Bool none = !isSubset(qsig, r->summary);
+		freeBits(qsig);
+		if (none) return new;
+		// a query that has been run before needs no scan either
+		if (getCachedPages(new, sigs)) return new;
+	}
+	findPages(new, sigs);
+	if (usesSigs) putCachedPages(new, sigs);
 	return new;
 }
 
+// match a compiled query against every tuple in a data page
+// - sets bit i in q->hits iff tuple i in the page matches
+// - works attribute-at-a-time across all slots, so each bound
+//   value is compared against the whole page in one tight loop
+//   and slots drop out as soon as one attribute fails
+// - if q->tuples is set, only the slots it selects are examined
+// - no allocation; works directly on the page bytes
+// - returns the number of matching tuples
+
+static Count matchPageTuples(Query q, Page p)
+{
+	Reln r = q->rel;
+	Count nitems = pageNitems(p);
+	Count tsize = tupSize(r);
+	Bits hits = q->hits;
+	char **cursor = q->cursor;
+	Count nhits = 0;
+	Count base = q->curpage*maxTupsPP(r); // tuple id of slot 0
+
+	unsetAllBits(hits);
+	for (int s = 0; s < nitems; s++) {
+		if (q->tuples != NULL && !bitIsSet(q->tuples, base+s))
+			continue;
+		setBit(hits, s);
+		cursor[s] = (char *)addrInPage(p, s, tsize);
+		nhits++;
+	}
+	q->ntuples += nhits;
+	for (int i = 0; i <= q->lastbound && nhits > 0; i++) {
+		Bool bound = !(q->qvals[i][0] == '?' && q->qlens[i] == 1);
+		char *val = q->qvals[i];
+		Count len = q->qlens[i];
+		for (int s = 0; s < nitems; s++) {
+			if (!bitIsSet(hits, s)) continue;
+			char *t = cursor[s];
+			char *end = (char *)addrInPage(p, s+1, tsize);
+			while (t < end && *t != ',' && *t != '\0') t++;
+			if (bound && (t-cursor[s] != len ||
+			              memcmp(cursor[s], val, len) != 0)) {
+				unsetBit(hits, s);
+				nhits--;
+			}
+			cursor[s] = t+1; // skip ','
+		}
+	}
+	return nhits;
+}
+
 // scan through selected pages (q->pages)
 // search for matching tuples and show each
 // accumulate query stats
 
 void scanAndDisplayMatchingTuples(Query q)
+{
+	scanMatchingTuples(q, showTuple);
+}
+
+// as scanAndDisplayMatchingTuples(), but each matching tuple
+//   is passed to show(), e.g. to frame it for a client
+
+void scanMatchingTuples(Query q, void (*show)(Reln, Tuple))
 {
 	assert(q != NULL);
 	//TODO
@@ -72,40 +258,109 @@ void scanAndDisplayMatchingTuples(Query q)
 	q->ntuppages = 0;
 	// scan selected pages to find matching tuples
 	Reln r = q->rel;
-	Tuple qry = q->qstring;
 	Bits pages = q->pages;
 	File dataf = dataFile(r);
 	Count npages = nPages(r); // number of data pages
+	Page curr = arenaAlloc(q->mem, PAGESIZE); // re-used for every page
+	assert(curr != NULL);
 	// showBits(pages);
 	// printf("\n");
 	
+	// q->pages is complete before the scan starts, so keep
+	// PREFETCH candidate pages in flight ahead of the one being
+	// matched; reading then overlaps with matching
+	PageID ahead = 0;  // next page to consider for prefetch
+	Count inflight = 0; // candidates prefetched but not yet read
 	for (q->curpage = 0; q->curpage < npages; q->curpage++){
 		if (!bitIsSet(pages, q->curpage)) {
 			continue;
 		}
+		for (; ahead < npages && inflight < PREFETCH; ahead++) {
+			if (!bitIsSet(pages, ahead)) continue;
+			prefetchPage(dataf, ahead);
+			inflight++;
+		}
+		inflight--;
 		q->ntuppages++;
-		Bool miss = TRUE;
-		Page curr = getPage(dataf,q->curpage);
+		readPage(dataf, q->curpage, curr);
 		Count nitems = pageNitems(curr);
 		
+		if (matchPageTuples(q, curr) == 0) {
+			q->nfalse++;
+			continue;
+		}
+		// only copy out the tuples we display
 		for (q->curtup=0;q->curtup<nitems;q->curtup++){
-			// get data for i'th tuple in Page (Reln r, Page p, int i)
-			q->ntuples++;
+			if (!bitIsSet(q->hits, q->curtup)) continue;
 			Tuple t2 = getTupleFromPage(r, curr, q->curtup); 
-			if (tupleMatch(r,qry,t2)){
-				showTuple(r,t2);
-				miss =FALSE;
-				free(t2);
-			}
-		}
-		if (miss == TRUE) {
-			q->nfalse++;
+			show(r,t2);
+			free(t2);
 		}
-		free(curr);
 	}
 	
 }
 
+// check every selection method against a full scan
+// - each method must select every data page that holds a
+//   matching tuple (and, for 'h', every matching tuple)
+// - each method is run twice: from scratch ("t"), and through
+//   startQuery() with summaries and the result cache ("t+")
+// - prints signature pages read and candidates per method
+// - returns the number of runs that missed an answer,
+//   or -1 if the query is not valid for the relation (or too
+//   big: 'h' needs the most memory, and is tried first)
+
+int checkSelections(Reln r, char *qstring)
+{
+	Query truth = newQuery(r, qstring, 'h');
+	if (truth == NULL)
+		return -1;
+	Page curr = arenaAlloc(truth->mem, PAGESIZE);
+	assert(curr != NULL);
+	Count tupPP = maxTupsPP(r);
+	int failed = 0;
+	char *methods = "tpbh";
+	for (char *m = methods; *m != '\0'; m++) {
+		for (int full = 0; full <= 1; full++) {
+			Query q;
+			if (full)
+				q = startQuery(r, qstring, *m);
+			else {
+				q = newQuery(r, qstring, *m);
+				findPages(q, *m);
+			}
+			Count ncand = 0, nanswer = 0, missed = 0;
+			for (PageID pid = 0; pid < nPages(r); pid++) {
+				if (bitIsSet(q->pages, pid)) ncand++;
+				readPage(dataFile(r), pid, curr);
+				truth->curpage = pid;
+				if (matchPageTuples(truth, curr) == 0) continue;
+				nanswer++;
+				if (!bitIsSet(q->pages, pid)) {
+					missed++;
+					continue;
+				}
+				if (q->tuples == NULL) continue;
+				for (Offset i = 0; i < pageNitems(curr); i++) {
+					if (bitIsSet(truth->hits, i) &&
+					    !bitIsSet(q->tuples, pid*tupPP + i)) {
+						missed++;
+						break;
+					}
+				}
+			}
+			printf("%c%c  sig pages: %d  sigs: %d  candidates: %d"
+			       "  answer pages: %d  missed: %d\n",
+			       *m, full ? '+' : ' ', q->nsigpages, q->nsigs,
+			       ncand, nanswer, missed);
+			if (missed > 0) failed++;
+			closeQuery(q);
+		}
+	}
+	closeQuery(truth);
+	return failed;
+}
+
 // print statistics on query
 
 void queryStats(Query q)
@@ -121,6 +376,7 @@ void queryStats(Query q)
 
 void closeQuery(Query q)
 {
-	free(q->pages);
+	freeVals(q->qvals, nAttrs(q->rel));
+	releaseArena(q->rel, q->mem);
 	free(q);
 }
@@ -2,6 +2,7 @@
 // part of signature indexed files
 // Written by John Shepherd, March 2019
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -13,6 +14,27 @@
 #include "psig.h"
 #include "bits.h"
 #include "hash.h"
+#include "bsig.h"
+#include "arena.h"
+#include "qcache.h"
+
+// version of the on-disk layout, kept in R.info after the
+//   summary; relations written before it existed have none
+// 1: psigs cover every tuple on their page, and summaries
+// 2: CATC attribute weights follow the format number, and
+//    CATC codewords use catcCodeword()'s choice of k
+// 3: bit-slices are blocked and packed at bit granularity
+//    (see bsig.c)
+#define RELNFORMAT 3
+
+// largest CATC attribute weight (see setAttrWeights())
+#define MAXWEIGHT 1000
+
+// codewords remembered per open relation (see relnCodeword())
+#define CWCACHESLOTS 1024
+
+// most tuples looked at by estimateAttrWeights()
+#define WEIGHTSAMPLE 1024
 
 // open a file with a specified suffix
 // - always open for both reading and writing
@@ -26,7 +48,371 @@ File openFile(char *name, char *suffix)
 	return f;
 }
 
-// create a new relation (five files)
+// a codeword: k distinct bits set among bits start..start+width-1
+//   of an m-bit signature, chosen by a generator seeded from
+//   the attribute value
+// - the generator state is private, so codewords can be built
+//   from several threads at once; it gives the same sequence
+//   as srandom()/random()
+
+Bits makeCodeword(char *attr_value, Count m, Count start, Count width, Count k)
+{
+	int counter = 0;
+	Bits cw = newBits(m);
+	struct random_data rd = {0};
+	char rstate[128];
+	initstate_r(hash_any(attr_value, strlen(attr_value)), rstate,
+	            sizeof(rstate), &rd);  // seed
+	if (k > width) k = width;
+	while (counter < k) {
+		int32_t rnd;
+		random_r(&rd, &rnd);
+		int i = start + rnd % width;
+		if (!bitIsSet(cw,i)){
+			setBit(cw,i);
+			counter++;
+		}
+	}
+	return cw; // m-bits with k 1-bits and m-k 0-bits
+}
+
+// a remembered codeword: makeCodeword()'s arguments and result
+typedef struct _CwEntry {
+	char *value;   // attribute value (NULL = empty slot)
+	Count m, start, width, k;
+	Bits cw;
+} CwEntry;
+
+struct _CwCacheRep {
+	CwEntry slots[CWCACHESLOTS];
+};
+
+// makeCodeword() for relation r, remembering the result
+// - building a codeword seeds a generator, which is costly
+//   next to the rest of a signature, and the same values
+//   recur across inserts and queries while r is open
+// - direct-mapped: a new codeword replaces whatever was in
+//   its slot; the arguments are part of the key, so changing
+//   the CATC weights needs no invalidation
+// - returns a copy, which the caller frees as usual
+
+Bits relnCodeword(Reln r, char *attr_value, Count m, Count start, Count width, Count k)
+{
+	if (r->cwcache == NULL) {
+		r->cwcache = calloc(1, sizeof(struct _CwCacheRep));
+		assert(r->cwcache != NULL);
+	}
+	uint32_t h = hash_any(attr_value, strlen(attr_value));
+	CwEntry *e = &(r->cwcache->slots[(h + 31*start + m) % CWCACHESLOTS]);
+	if (e->value == NULL || e->m != m || e->start != start ||
+	    e->width != width || e->k != k || strcmp(e->value, attr_value) != 0) {
+		if (e->value != NULL) {
+			free(e->value);
+			freeBits(e->cw);
+		}
+		e->value = strdup(attr_value);
+		assert(e->value != NULL);
+		e->m = m; e->start = start; e->width = width; e->k = k;
+		e->cw = makeCodeword(attr_value, m, start, width, k);
+	}
+	Bits cw = newBits(m);
+	orBits(cw, e->cw);
+	return cw;
+}
+
+// release the codewords remembered for r
+
+static void freeCodewords(Reln r)
+{
+	if (r->cwcache == NULL) return;
+	for (int i = 0; i < CWCACHESLOTS; i++) {
+		CwEntry *e = &(r->cwcache->slots[i]);
+		if (e->value == NULL) continue;
+		free(e->value);
+		freeBits(e->cw);
+	}
+	free(r->cwcache);
+	r->cwcache = NULL;
+}
+
+// region of an m-bit CATC signature owned by attribute attr
+// - every attribute gets one bit, and the rest of the m bits
+//   are shared out in proportion to the attribute weights
+//   (see setAttrWeights())
+// - attribute 0 also gets the left-over bits, and comes first
+
+void catcRegion(Reln r, Count m, int attr, Count *start, Count *width)
+{
+	Count n = r->params.nattrs;
+	int64_t total = 0; // weights are at most MAXWEIGHT, but be safe
+	for (int i = 0; i < n; i++) total += r->weights[i];
+	Count spare = m - n, used = 0;
+	*start = 0;
+	for (int i = 0; i < n; i++) {
+		Count w = 1 + (Count)((int64_t)spare*r->weights[i]/total);
+		used += w;
+		if (i == attr) *width = w;
+		if (i < attr) *start += w;
+	}
+	if (attr == 0)
+		*width += m - used;
+	else
+		*start += m - used;
+}
+
+// CATC codeword for one attribute value in an m-bit signature
+//   that is the OR of the codewords of n tuples
+// - a region of w bits holding n codewords stays about half
+//   full with k = w*ln(2)/n bits set in each one, which gives
+//   the lowest false match rate for that region
+// - no more bits are set than a false match rate of pF needs,
+//   i.e. log2(1/pF), so sparse tsig regions are not wasted
+
+Bits catcCodeword(Reln r, Count m, Count n, int attr, char *attr_value)
+{
+	Count start, width;
+	catcRegion(r, m, attr, &start, &width);
+	Count kmax = 1;
+	for (double p = 2.0; p*r->params.pF < 1.0; p *= 2.0) kmax++;
+	Count k = (width*693 + n*500) / (n*1000);
+	if (k > kmax) k = kmax;
+	if (k < 1) k = 1;
+	return relnCodeword(r, attr_value, m, start, width, k);
+}
+
+// fold a page signature into the summary for its psig page
+// - the .ssig file holds one summary per psig page: the OR
+//   of every psig on that page (i.e. of psigPP data pages)
+// - the relation-wide summary (r->summary) is the OR of all
+//   of these, and is kept in the .info file after RelnParams
+// - so there are two fixed levels, not a tree of summaries:
+//   a query reads every .ssig page (1/psigPP of the psig
+//   file), and each insert costs one more .ssig page read
+//   and write
+
+static void addToSummary(Reln r, PageID ppid, Bits psig)
+{
+	Count psigPP = r->params.psigPP;
+	PageID spid = ppid / psigPP;
+	Offset pos = ppid % psigPP;
+	Page p;
+	if (spid >= lseek(r->ssigf, 0, SEEK_END)/PAGESIZE) {
+		addPage(r->ssigf);
+		p = newPage();
+	}
+	else
+		p = getPage(r->ssigf, spid);
+	Bits ssig = newBits(r->params.pm);
+	if (pos < pageNitems(p))
+		getBits(p, pos, ssig);
+	else
+		addOneItem(p);
+	orBits(ssig, psig);
+	putBits(p, pos, ssig);
+	putPage(r->ssigf, spid, p);
+	freeBits(ssig);
+	orBits(r->summary, psig);
+}
+
+// (re)build all summaries from the .psig file
+
+static void buildSummaries(Reln r)
+{
+	RelnParams *rp = &(r->params);
+	int ok = ftruncate(r->ssigf, 0);
+	assert(ok == 0);
+	addPage(r->ssigf);
+	unsetAllBits(r->summary);
+	Bits psig = newBits(rp->pm);
+	Bits acc = newBits(rp->pm);
+	for (PageID pid = 0; pid < rp->psigNpages; pid++) {
+		Page p = getPage(r->psigf, pid);
+		unsetAllBits(acc);
+		for (Offset i = 0; i < pageNitems(p); i++) {
+			getBits(p, i, psig);
+			orBits(acc, psig);
+		}
+		if (pageNitems(p) > 0)
+			addToSummary(r, pid, acc);
+		free(p);
+	}
+	freeBits(acc);
+	freeBits(psig);
+}
+
+// rebuild the .tsig file from the data file
+
+static void rebuildTupleSigs(Reln r)
+{
+	RelnParams *rp = &(r->params);
+	int ok = ftruncate(r->tsigf, 0);
+	assert(ok == 0);
+	addPage(r->tsigf);
+	rp->tsigNpages = 1; rp->ntsigs = 0;
+	Page tp = newPage();
+	for (PageID pid = 0; pid < rp->npages; pid++) {
+		Page p = getPage(r->dataf, pid);
+		for (Offset i = 0; i < pageNitems(p); i++) {
+			Tuple t = getTupleFromPage(r, p, i);
+			Bits tsig = makeTupleSig(r, t);
+			if (pageNitems(tp) == rp->tsigPP) {
+				putPage(r->tsigf, rp->tsigNpages-1, tp);
+				addPage(r->tsigf);
+				rp->tsigNpages++;
+				tp = newPage();
+			}
+			putBits(tp, pageNitems(tp), tsig);
+			addOneItem(tp);
+			rp->ntsigs++;
+			freeBits(tsig);
+			free(t);
+		}
+		free(p);
+	}
+	putPage(r->tsigf, rp->tsigNpages-1, tp);
+}
+
+// rebuild the .psig file from the data file
+// - one psig per data page: the OR of the page signatures of
+//   every tuple on it
+
+static void rebuildPageSigs(Reln r)
+{
+	RelnParams *rp = &(r->params);
+	int ok = ftruncate(r->psigf, 0);
+	assert(ok == 0);
+	addPage(r->psigf);
+	rp->psigNpages = 1; rp->npsigs = 0;
+	Page pp = newPage();
+	Bits psig = newBits(rp->pm);
+	for (PageID pid = 0; pid < rp->npages; pid++) {
+		Page p = getPage(r->dataf, pid);
+		if (pageNitems(p) == 0) { free(p); continue; }
+		unsetAllBits(psig);
+		for (Offset i = 0; i < pageNitems(p); i++) {
+			Tuple t = getTupleFromPage(r, p, i);
+			Bits tpsig = makePageSig(r, t);
+			orBits(psig, tpsig);
+			freeBits(tpsig);
+			free(t);
+		}
+		free(p);
+		if (pageNitems(pp) == rp->psigPP) {
+			putPage(r->psigf, rp->psigNpages-1, pp);
+			addPage(r->psigf);
+			rp->psigNpages++;
+			pp = newPage();
+		}
+		putBits(pp, pageNitems(pp), psig);
+		addOneItem(pp);
+		rp->npsigs++;
+	}
+	putPage(r->psigf, rp->psigNpages-1, pp);
+	freeBits(psig);
+}
+
+// rebuild every signature file, and the summaries, from the
+//   data file, e.g. after the CATC weights change
+// cached query results are dropped, as they depend on psigs
+
+void rebuildSignatures(Reln r)
+{
+	rebuildTupleSigs(r);
+	rebuildPageSigs(r);
+	buildSummaries(r);
+	rebuildBitSlices(r);
+	clearQueryCache(r);
+}
+
+// bring a relation written by an older version up to date
+// - before format 1, a psig only covered the first tuple of
+//   its data page, so psigs are rebuilt from the data file
+//   rather than trusted, and summaries from the psigs
+// - before format 2, CATC codewords were chosen differently,
+//   so every signature of a CATC relation is rebuilt
+// - before format 3, R.bsig may have one slice per row across
+//   many pages, or slices blocked at byte granularity, and
+//   its parameters cannot tell which; it is rebuilt from the
+//   psigs in the current layout
+// - the result is written back, so this happens only once
+
+static void upgradeRelation(Reln r, Count format)
+{
+	if (format < 2 && sigType(r) == 'c')
+		rebuildSignatures(r);
+	else {
+		if (format < 1) {
+			rebuildPageSigs(r);
+			buildSummaries(r);
+		}
+		rebuildBitSlices(r);
+		clearQueryCache(r);
+	}
+	syncRelation(r);
+}
+
+// change the CATC attribute weights of a relation
+// - weights[i] in 1..MAXWEIGHT is attribute i's share of each CATC
+//   signature (see catcRegion()); give more to attributes
+//   with more distinct values, as they are more selective
+// - every signature is rebuilt to match
+
+Status setAttrWeights(Reln r, Count *weights)
+{
+	for (int i = 0; i < nAttrs(r); i++)
+		if ((int)weights[i] < 1 || (int)weights[i] > MAXWEIGHT) return -1;
+	memcpy(r->weights, weights, nAttrs(r)*sizeof(Count));
+	if (sigType(r) == 'c')
+		rebuildSignatures(r);
+	syncRelation(r);
+	return 0;
+}
+
+// compare two attribute values (for qsort())
+
+static int cmpVals(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+// weights in proportion to the selectivity of each attribute
+// - from the number of distinct values d of the attribute in
+//   up to WEIGHTSAMPLE tuples spread over the relation
+// - weight 1+log2(d) is about the number of bits needed to
+//   tell d values apart
+
+void estimateAttrWeights(Reln r, Count *weights)
+{
+	Count n = nAttrs(r);
+	Count nsample = nTuples(r) < WEIGHTSAMPLE ? nTuples(r) : WEIGHTSAMPLE;
+	char ***vals = malloc(nsample*sizeof(char **));
+	char **col = malloc((nsample+1)*sizeof(char *));
+	assert(vals != NULL && col != NULL);
+	for (Count s = 0; s < nsample; s++) {
+		Count tid = (Count)((long)s*nTuples(r)/nsample);
+		Page p = getPage(r->dataf, tid/maxTupsPP(r));
+		Tuple t = getTupleFromPage(r, p, tid%maxTupsPP(r));
+		vals[s] = tupleVals(r, t);
+		free(t);
+		free(p);
+	}
+	for (int i = 0; i < n; i++) {
+		for (Count s = 0; s < nsample; s++)
+			col[s] = vals[s][i];
+		qsort(col, nsample, sizeof(char *), cmpVals);
+		Count d = (nsample > 0) ? 1 : 0;
+		for (Count s = 1; s < nsample; s++)
+			if (strcmp(col[s-1], col[s]) != 0) d++;
+		weights[i] = 1;
+		for (Count v = 2; v <= d; v *= 2) weights[i]++;
+	}
+	for (Count s = 0; s < nsample; s++)
+		freeVals(vals[s], n);
+	free(col);
+	free(vals);
+}
+
+// create a new relation (seven files)
 // data file has one empty data page
 
 Status newRelation(char *name, Count nattrs, float pF, char sigtype,
@@ -47,44 +433,40 @@ Status newRelation(char *name, Count nattrs, float pF, char sigtype,
 	if (pm%8 > 0) pm += 8-(pm%8); // round up to byte size
 	p->pm = pm; p->psigSize = pm/8; p->psigPP = available/(pm/8);
 	if (p->psigPP < 2) { free(r); return -1; }
-	if (bm%8 > 0) bm += 8-(bm%8); // round up to byte size
-	p->bm = bm; p->bsigSize = bm/8; p->bsigPP = available/(bm/8);
-	if (p->bsigPP < 2) { free(r); return -1; }
+	if (sigtype == 'c' && (tm < nattrs || pm < nattrs)) { free(r); return -1; }
+	// bsig pages are blocked (see bsig.c), so the slice width
+	// follows from pm; bm only caps it, if it is > 0
+	if (setBsigParams(p, bm) < 0) { free(r); return -1; }
 	r->infof = openFile(name,"info");
 	r->dataf = openFile(name,"data");
 	r->tsigf = openFile(name,"tsig");
 	r->psigf = openFile(name,"psig");
 	r->bsigf = openFile(name,"bsig");
+	r->ssigf = openFile(name,"ssig");
+	r->qcachef = openFile(name,"qcache");
+	// nothing from an older relation called R survives
+	File files[] = { r->infof, r->dataf, r->tsigf, r->psigf,
+	                 r->bsigf, r->ssigf, r->qcachef };
+	for (int i = 0; i < 7; i++) {
+		int ok = ftruncate(files[i], 0);
+		assert(ok == 0);
+	}
+	r->summary = newBits(p->pm);
+	r->narenas = 0;
+	r->qcache = NULL;
+	r->cwcache = NULL;
+	r->weights = malloc(nattrs*sizeof(Count));
+	assert(r->weights != NULL);
+	for (int i = 0; i < nattrs; i++)
+		r->weights[i] = 1; // equal regions until set otherwise
+	addPage(r->ssigf);
 	addPage(r->dataf); p->npages = 1; p->ntups = 0;
 	addPage(r->tsigf); p->tsigNpages = 1; p->ntsigs = 0;
 	addPage(r->psigf); p->psigNpages = 1; p->npsigs = 0;
-	addPage(r->bsigf); p->bsigNpages = 1; p->nbsigs = 0; // replace this
-	// Create a file containing "pm" all-zeroes bit-strings,
-    // each of which has length "bm" bits
-	//TODO
-	
-	// bm is the width of bsig, equal to maxpages
-	Bits bsig = newBits(p->bm);
-	PageID pid = 0;
-	Page curr = getPage(r->bsigf, pid);
-	// pm is the number of bsigs
-	for (int i = 0; i < p->pm; i++) {
-		// check if room on last page;
-		if (pageNitems(curr) == p->bsigPP) {
-			putPage(r->bsigf, pid, curr);
-			addPage(r->bsigf);
-			p->bsigNpages++; // number of bsig pages
-			pid++;
-			free(curr);
-			curr = newPage();
-			if (curr == NULL) return -1;;
-		}
-		putBits(curr, pageNitems(curr), bsig);
-		addOneItem(curr); // page->nitems++; 
-		p->nbsigs++;     // number of bit-slice signatures (bsigs)
-	}
-	putPage(r->bsigf, pid, curr);
-	freeBits(bsig);
+	// bit-slices are blocked: each bsig page holds all "pm"
+	// slices, each covering the next "bm" data pages
+	addPage(r->bsigf); p->bsigNpages = 1; p->nbsigs = p->pm;
+	putPage(r->bsigf, 0, newBsigPage(r));
 	
 	closeRelation(r);
 	return 0;
@@ -117,22 +499,63 @@ Reln openRelation(char *name)
 	r->tsigf = openFile(name,"tsig");
 	r->psigf = openFile(name,"psig");
 	r->bsigf = openFile(name,"bsig");
+	r->ssigf = openFile(name,"ssig");
+	r->qcachef = openFile(name,"qcache");
 	read(r->infof, &(r->params), sizeof(RelnParams));
+	r->summary = newBits(r->params.pm);
+	r->narenas = 0;
+	r->qcache = NULL;
+	r->cwcache = NULL;
+	Count n = r->params.nattrs;
+	r->weights = malloc(n*sizeof(Count));
+	assert(r->weights != NULL);
+	for (int i = 0; i < n; i++)
+		r->weights[i] = 1;
+	Count format = 0;
+	if (readBits(r->infof, r->summary) &&
+	    read(r->infof, &format, sizeof(Count)) == sizeof(Count) &&
+	    format >= 2)
+		read(r->infof, r->weights, n*sizeof(Count));
+	if (format != RELNFORMAT)
+		upgradeRelation(r, format);
 	return r;
 }
 
-// release files and descriptor for an open relation
-// copy latest information to .info file
+// copy latest information (and summary) to .info file, and
+//   write back the query cache if it has changed (see qcache.c)
+// lets a long-running process keep a relation open
 // note: we don't write ChoiceVector since it doesn't change
 
-void closeRelation(Reln r)
+void syncRelation(Reln r)
 {
 	// make sure updated global data is put in info file
 	lseek(r->infof, 0, SEEK_SET);
 	int n = write(r->infof, &(r->params), sizeof(RelnParams));
 	assert(n == sizeof(RelnParams));
+	writeBits(r->infof, r->summary);
+	Count format = RELNFORMAT;
+	n = write(r->infof, &format, sizeof(Count));
+	assert(n == sizeof(Count));
+	n = write(r->infof, r->weights, nAttrs(r)*sizeof(Count));
+	assert(n == nAttrs(r)*sizeof(Count));
+	syncQueryCache(r);
+}
+
+// release files and descriptor for an open relation
+// copy latest information (and summary) to .info file
+
+void closeRelation(Reln r)
+{
+	syncRelation(r);
 	close(r->infof); close(r->dataf);
 	close(r->tsigf); close(r->psigf); close(r->bsigf);
+	close(r->ssigf); close(r->qcachef);
+	freeBits(r->summary);
+	free(r->weights);
+	freeQueryCache(r);
+	freeCodewords(r);
+	while (r->narenas > 0)
+		freeArena(r->arenas[--r->narenas]);
 	free(r);
 }
 
@@ -146,6 +569,7 @@ PageID addToRelation(Reln r, Tuple t)
 	Page p;  PageID pid;
 	RelnParams *rp = &(r->params);
 	Bool new =  FALSE; // set as true if need to create a new page
+	PageID dpid;       // data page where the tuple goes
 	
 	// add tuple to last page
 	pid = rp->npages-1;
@@ -163,6 +587,7 @@ PageID addToRelation(Reln r, Tuple t)
 	addTupleToPage(r, p, t);
 	rp->ntups++;  //written to disk in closeRelation()
 	putPage(r->dataf, pid, p);
+	dpid = pid;
 	
 	// compute tuple signature and add to tsigf
 	//TODO
@@ -223,52 +648,19 @@ PageID addToRelation(Reln r, Tuple t)
 		Bits cpsig = newBits(psigBits(r));
 		// get the last item and update
 		getBits(p,pageNitems(p)-1,cpsig);
+		orBits(cpsig,psig);
 		putBits(p,pageNitems(p)-1,cpsig);
 		freeBits(cpsig);
 		putPage(r->psigf, pid, p);
 	}	
-	// freeBits(psig);
+	// keep the psig-page and relation-wide summaries covering it
+	addToSummary(r, pid, psig);
 
 	// use page signature to update bit-slices
-	//TODO
-	
-	// update pagesig or add psig
-	// update each entry of bit-slice page
-	// pm is fixed (maxpages), we don't need to change it even adding new psig.
+	// all slices for this data page are on one bsig page
+	addToBitSlices(r, dpid, psig);
+	freeBits(psig);
 	
-	// Bits bsig = makeTupleSig(r, t);
-	// pid = rp->bsigNpages-1;
-	
-	// p = getPage(r->bsigf, pid);
-	// if (pageNitems(p) == rp->psigPP) {
-	// 	addPage(r->psigf);
-	// 	rp->psigNpages++;
-	// 	pid++;
-	// 	free(p);
-	// 	p = newPage();
-	// 	if (p == NULL) return NO_PAGE;
-	// }
-	// putBits(p, pageNitems(p)-1, psig);
-	// putPage(r->psigf, pid, p);
-	// rp->npsigs++;
-	
-	// rp->nbsigs++;
-	
-	for (int i = 0; i < rp->pm; i++) {
-		if (bitIsSet(psig, i)) {
-			Bits bsig = newBits(bsigBits(r));
-			PageID bpid = i / rp->bsigPP;
-			p = getPage(r->bsigf, bpid);
-			Offset pos = i % rp->bsigPP;
-			getBits(p, pos, bsig);
-			setBit(bsig, bpid);
-			putBits(p, pos, bsig);
-			putPage(r->bsigf, bpid, p);
-		}
-	}
-	
-	// rp->bsigNpages++;
-
 	return nPages(r)-1;
 }
 
@@ -290,6 +682,19 @@ void relationStats(Reln r)
             p->sigtype == 'c' ? "catc" : "simc");
     if (p->sigtype == 's')
 	    printf("  bits/attr: %d", p->tk);
+    else {
+	    Count start, width;
+	    printf("  tsig/psig bits per attr:");
+	    for (int i = 0; i < p->nattrs; i++) {
+		    catcRegion(r, p->tm, i, &start, &width);
+		    printf(" %d", width);
+		    catcRegion(r, p->pm, i, &start, &width);
+		    printf("/%d", width);
+	    }
+	    printf("  weights:");
+	    for (int i = 0; i < p->nattrs; i++)
+		    printf(" %d", r->weights[i]);
+    }
     printf("\n");
 	printf("  tsigs  size: %d bits (%d bytes)  max/page: %d\n",
 			p->tm, p->tsigSize, p->tsigPP);
@@ -0,0 +1,462 @@
+// server.c ... long-running front end for signature indexed files
+// part of signature indexed files
+// Keeps relations open across requests, so the cost of opening
+//   the relation files and reading R.info is paid once; what
+//   an open relation keeps warm stays warm too: its summaries,
+//   query cache, query arenas and codewords (see reln.c)
+// Usage:  ./server  [-s SocketPath]
+//         ./server  -f Rounds [Seed]
+// With -f, runs the selection fuzzer on Rounds scratch
+//   relations with random parameters instead (see fuzzRelations())
+//   and exits with status 1 if any method missed an answer
+// Reads requests from stdin (or from each client connecting to
+//   the Unix socket), one per line:
+//     insert R        then tuples, one per line, ending with "."
+//     query R t|p|b|h|s v1,v2,...   matching tuples, one per line
+//     queries R t|p|b|h|s   then queries, one per line, ending
+//                     with "."; each is answered as for "query",
+//                     then "ok N" ends the batch
+//     stats R         relationStats() output
+//     rebuild R       rebuild R.bsig from R.psig
+//     weights R auto|w1,w2,...   set the CATC attribute
+//                     weights (estimated from the data for
+//                     "auto") and rebuild the signatures
+//     check R v1,v2,...   compare every selection method with
+//                     a full scan (see checkSelections())
+//     fuzz R N [Seed] check N random queries built from tuples
+//                     in R; some values are altered so that
+//                     absent keys are covered too
+//     sync            write .info for every open relation
+//     close R         close a relation (it reopens on next use)
+//     quit            end this session
+// Every request is answered by a final line starting "ok" or
+//   "error"; for queries "ok" is followed by the query stats:
+//   sigpages sigs datapages tuples falsematches
+// Each matching tuple is sent on a line starting "= ", so a
+//   tuple can never be taken for the final line
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "defs.h"
+#include "reln.h"
+#include "query.h"
+#include "tuple.h"
+#include "bsig.h"
+#include "page.h"
+
+#define USAGE "./server  [-s SocketPath | -f Rounds [Seed]]"
+#define MAXLINE 1024
+#define MAXOPEN 32
+
+// relations held open by the server
+static struct {
+	char name[MAXFILENAME];
+	Reln rel;
+} openRelns[MAXOPEN];
+static int nOpen = 0;
+
+// find an open relation, opening it if need be
+// returns NULL if there is no such relation
+
+static Reln getReln(char *name)
+{
+	for (int i = 0; i < nOpen; i++) {
+		if (strcmp(openRelns[i].name, name) == 0)
+			return openRelns[i].rel;
+	}
+	if (nOpen == MAXOPEN || strlen(name) >= MAXFILENAME ||
+	    !existsRelation(name))
+		return NULL;
+	strcpy(openRelns[nOpen].name, name);
+	openRelns[nOpen].rel = openRelation(name);
+	return openRelns[nOpen++].rel;
+}
+
+static void closeReln(char *name)
+{
+	for (int i = 0; i < nOpen; i++) {
+		if (strcmp(openRelns[i].name, name) == 0) {
+			closeRelation(openRelns[i].rel);
+			openRelns[i] = openRelns[--nOpen];
+			return;
+		}
+	}
+}
+
+// remove trailing newline from a line read by fgets()
+
+static void chomp(char *line)
+{
+	Count n = strlen(line);
+	while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+		line[--n] = '\0';
+}
+
+// does a tuple have a value for every attribute
+// a "?" (which only makes sense in queries) counts as none
+
+static Bool completeTuple(Reln r, char *line)
+{
+	if (strlen(line) != tupSize(r) || !checkQuery(r, line))
+		return FALSE;
+	char **vals = tupleVals(r, line);
+	Bool ok = TRUE;
+	for (int i = 0; i < nAttrs(r); i++) {
+		if (strcmp(vals[i], "?") == 0) ok = FALSE;
+	}
+	freeVals(vals, nAttrs(r));
+	return ok;
+}
+
+// read tuples until "." and insert them into r
+// the whole batch is committed to R.info once at the end
+
+static void doInsert(FILE *in, Reln r)
+{
+	char line[MAXLINE];
+	Count ok = 0, bad = 0;
+	while (fgets(line, MAXLINE, in) != NULL) {
+		chomp(line);
+		if (strcmp(line, ".") == 0) break;
+		if (!completeTuple(r, line)) {
+			bad++;
+			continue;
+		}
+		if (addToRelation(r, line) == NO_PAGE)
+			bad++;
+		else
+			ok++;
+	}
+	syncRelation(r);
+	if (bad > 0)
+		printf("error %d inserted, %d rejected\n", ok, bad);
+	else
+		printf("ok %d\n", ok);
+}
+
+// set the CATC attribute weights from "auto" or a list
+
+static void doWeights(Reln r, char *spec)
+{
+	Count weights[MAXLINE];
+	if (strcmp(spec, "auto") == 0)
+		estimateAttrWeights(r, weights);
+	else {
+		int n = 0;
+		for (char *w = strtok(spec, ","); w != NULL; w = strtok(NULL, ",")) {
+			if (n == nAttrs(r)) { n++; break; }
+			weights[n++] = atoi(w);
+		}
+		if (n != nAttrs(r)) {
+			printf("error need %d weights\n", nAttrs(r));
+			return;
+		}
+	}
+	if (setAttrWeights(r, weights) < 0) {
+		printf("error weights must be 1..1000\n");
+		return;
+	}
+	for (int i = 0; i < nAttrs(r); i++)
+		printf("%s%d", i > 0 ? "," : "ok ", weights[i]);
+	printf("\n");
+}
+
+// send one matching tuple to the client
+
+static void showResult(Reln r, Tuple t)
+{
+	printf("= %s\n", t);
+}
+
+static void doQuery(Reln r, char sigs, char *qstring)
+{
+	Query q = startQuery(r, qstring, sigs);
+	if (q == NULL) {
+		printf("error %s\n", checkQuery(r, qstring) ? "query needs too much memory"
+		                                             : "invalid query");
+		return;
+	}
+	scanMatchingTuples(q, showResult);
+	printf("ok %d %d %d %d %d\n", q->nsigpages, q->nsigs,
+	       q->ntuppages, q->ntuples, q->nfalse);
+	closeQuery(q);
+}
+
+// read queries until "." and answer each in turn
+
+static void doQueries(FILE *in, Reln r, char sigs)
+{
+	char line[MAXLINE];
+	Count n = 0;
+	while (fgets(line, MAXLINE, in) != NULL) {
+		chomp(line);
+		if (strcmp(line, ".") == 0) break;
+		doQuery(r, sigs, line);
+		n++;
+	}
+	printf("ok %d\n", n);
+}
+
+// build a random query from a random tuple of r
+// - each attribute is kept or replaced by "?" with equal odds
+// - one kept value in four has its last character changed,
+//   which usually gives a value that is not in the relation
+
+static void randomQuery(Reln r, char *qbuf)
+{
+	Count tid = random() % nTuples(r);
+	Page p = getPage(dataFile(r), tid / maxTupsPP(r));
+	Tuple t = getTupleFromPage(r, p, tid % maxTupsPP(r));
+	free(p);
+	char **vals = tupleVals(r, t);
+	qbuf[0] = '\0';
+	for (int i = 0; i < nAttrs(r); i++) {
+		if (i > 0) strcat(qbuf, ",");
+		if (random() % 2 == 0) {
+			strcat(qbuf, "?");
+			continue;
+		}
+		Count n = strlen(vals[i]);
+		if (n > 0 && random() % 4 == 0)
+			vals[i][n-1] = (vals[i][n-1] == 'z') ? 'y' : 'z';
+		strcat(qbuf, vals[i]);
+	}
+	freeVals(vals, nAttrs(r));
+	free(t);
+}
+
+// check n random queries on r against a full scan
+// returns the number of queries for which a method missed
+
+static int doFuzz(Reln r, Count n, unsigned seed)
+{
+	char qbuf[MAXLINE];
+	int failed = 0;
+	if (nTuples(r) == 0) {
+		printf("error relation is empty\n");
+		return 0;
+	}
+	srandom(seed);
+	for (int i = 0; i < n; i++) {
+		randomQuery(r, qbuf);
+		printf("query %s\n", qbuf);
+		if (checkSelections(r, qbuf) != 0) failed++;
+	}
+	if (failed > 0)
+		printf("error %d of %d queries missed answers\n", failed, n);
+	else
+		printf("ok %d\n", n);
+	return failed;
+}
+
+// run doFuzz() on nrounds scratch relations with random
+//   parameters (attributes, signature type and widths, bm)
+//   and a random number of generated tuples
+// - tuples look like gendata's: a 7-digit key, a 20-character
+//   name, then values "aN-xxx"; names and values repeat, so
+//   non-key queries have several answers
+// - the relations are removed afterwards
+// returns the number of rounds in which a method missed
+
+static int fuzzRelations(int nrounds, unsigned seed)
+{
+	char *suffixes[] = { "info", "data", "tsig", "psig", "bsig", "ssig", "qcache" };
+	char name[MAXFILENAME], fname[MAXFILENAME], t[MAXLINE];
+	float pFs[] = { 0.01, 0.001, 0.0001 };
+	int failed = 0;
+	snprintf(name, MAXFILENAME, "fuzz%d", (int)getpid());
+	for (int round = 0; round < nrounds; round++) {
+		srandom(seed + round);
+		Count nattrs = 2 + random() % 8;
+		char sigtype = (random() % 2) ? 'c' : 's';
+		float pF = pFs[random() % 3];
+		Count tk = 2 + random() % 12;
+		Count tm = 32 + random() % 480;
+		Count pm = 64 + random() % 8128;
+		Count bm = (random() % 2) ? 8 + random() % 120 : 0;
+		Count ntups = 1 + random() % 10000;
+		printf("round %d: nattrs %d sigtype %c pF %g tk %d tm %d pm %d bm %d tuples %d\n",
+		       round, nattrs, sigtype, pF, tk, tm, pm, bm, ntups);
+		if (newRelation(name, nattrs, pF, sigtype, tk, tm, pm, bm) < 0) {
+			printf("error can't create relation\n");
+			failed++;
+			continue;
+		}
+		Reln r = openRelation(name);
+		for (int i = 0; i < ntups; i++) {
+			int n = sprintf(t, "%07d,nm%018d", 1000000+i, (int)(random() % 50));
+			for (int a = 2; a < nattrs; a++)
+				n += sprintf(t+n, ",a%d-%03d", a, (int)(random() % 1000));
+			addToRelation(r, t);
+		}
+		if (doFuzz(r, 20, seed + round) > 0) failed++;
+		closeRelation(r);
+		for (int i = 0; i < 7; i++) {
+			snprintf(fname, MAXFILENAME, "%s.%s", name, suffixes[i]);
+			unlink(fname);
+		}
+		fflush(stdout);
+	}
+	printf("%s %d of %d rounds failed\n", failed ? "error" : "ok", failed, nrounds);
+	return failed;
+}
+
+// write all of the open relations back to their .info files
+
+static void syncAll(void)
+{
+	for (int i = 0; i < nOpen; i++)
+		syncRelation(openRelns[i].rel);
+}
+
+// handle requests until "quit" or end of input
+// also stops if a reply cannot be written (e.g. the client
+//   has gone away)
+
+static void serve(FILE *in)
+{
+	char line[MAXLINE];
+	while (fgets(line, MAXLINE, in) != NULL) {
+		chomp(line);
+		char *cmd = strtok(line, " ");
+		char *rname = strtok(NULL, " ");
+		if (cmd == NULL)
+			continue;
+		if (strcmp(cmd, "quit") == 0) {
+			printf("ok\n");
+			fflush(stdout);
+			return;
+		}
+		if (strcmp(cmd, "sync") == 0) {
+			syncAll();
+			printf("ok\n");
+		}
+		else if (rname == NULL)
+			printf("error %s needs a relation name\n", cmd);
+		else if (strcmp(cmd, "close") == 0) {
+			closeReln(rname);
+			printf("ok\n");
+		}
+		else {
+			Reln r = getReln(rname);
+			if (r == NULL)
+				printf("error no relation %s\n", rname);
+			else if (strcmp(cmd, "insert") == 0)
+				doInsert(in, r);
+			else if (strcmp(cmd, "rebuild") == 0) {
+				if (rebuildBitSlices(r) < 0)
+					printf("error psigs too wide for bit-slices\n");
+				else {
+					syncRelation(r);
+					printf("ok %d\n", nBsigPages(r));
+				}
+			}
+			else if (strcmp(cmd, "weights") == 0) {
+				char *spec = strtok(NULL, " ");
+				if (spec == NULL)
+					printf("error usage: weights R auto|w1,w2,...\n");
+				else
+					doWeights(r, spec);
+			}
+			else if (strcmp(cmd, "check") == 0) {
+				char *qstring = strtok(NULL, "");
+				int failed = (qstring == NULL) ? -1
+				           : checkSelections(r, qstring);
+				if (failed < 0 && qstring != NULL && checkQuery(r, qstring))
+					printf("error query needs too much memory\n");
+				else if (failed < 0)
+					printf("error invalid query\n");
+				else if (failed > 0)
+					printf("error %d methods missed answers\n", failed);
+				else
+					printf("ok\n");
+			}
+			else if (strcmp(cmd, "fuzz") == 0) {
+				char *n = strtok(NULL, " ");
+				char *seed = strtok(NULL, " ");
+				if (n == NULL)
+					printf("error usage: fuzz R N [Seed]\n");
+				else
+					doFuzz(r, atoi(n), seed ? atoi(seed) : 1);
+			}
+			else if (strcmp(cmd, "stats") == 0) {
+				relationStats(r);
+				printf("ok\n");
+			}
+			else if (strcmp(cmd, "query") == 0) {
+				char *sigs = strtok(NULL, " ");
+				char *qstring = strtok(NULL, "");
+				if (sigs == NULL || qstring == NULL)
+					printf("error usage: query R t|p|b|h|s q\n");
+				else
+					doQuery(r, sigs[0], qstring);
+			}
+			else if (strcmp(cmd, "queries") == 0) {
+				char *sigs = strtok(NULL, " ");
+				if (sigs == NULL)
+					printf("error usage: queries R t|p|b|h|s\n");
+				else
+					doQueries(in, r, sigs[0]);
+			}
+			else
+				printf("error unknown request %s\n", cmd);
+		}
+		if (fflush(stdout) == EOF || ferror(stdout)) {
+			clearerr(stdout);
+			return;
+		}
+	}
+}
+
+// accept clients on a Unix socket, one at a time
+// the client's connection becomes stdout while it is served
+// a client that disconnects early must not kill the server
+//   (SIGPIPE), and every relation is synced after each client
+
+static void serveSocket(char *path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fatal("Socket path too long", USAGE);
+	File s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) fatal("Can't create socket", "");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(s, 8) < 0)
+		fatal("Can't listen on socket", "");
+	signal(SIGPIPE, SIG_IGN);
+	File saved = dup(STDOUT_FILENO);
+	for (;;) {
+		File conn = accept(s, NULL, NULL);
+		if (conn < 0) continue;
+		FILE *in = fdopen(conn, "r");
+		fflush(stdout);
+		dup2(conn, STDOUT_FILENO);
+		serve(in);
+		fflush(stdout);
+		clearerr(stdout);
+		dup2(saved, STDOUT_FILENO);
+		fclose(in);
+		syncAll();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && strcmp(argv[1], "-s") == 0)
+		serveSocket(argv[2]);
+	else if ((argc == 3 || argc == 4) && strcmp(argv[1], "-f") == 0)
+		return fuzzRelations(atoi(argv[2]), argc == 4 ? atoi(argv[3]) : 1) > 0;
+	else if (argc == 1)
+		serve(stdin);
+	else
+		fatal("", USAGE);
+	while (nOpen > 0)
+		closeReln(openRelns[0].name);
+	return 0;
+}
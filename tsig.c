@@ -3,27 +3,22 @@
 // Written by John Shepherd, March 2019
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include "defs.h"
 #include "tsig.h"
+#include "psig.h"
 #include "reln.h"
 #include "hash.h"
 #include "bits.h"
+#include "page.h"
+#include "arena.h"
+#include "tuple.h"
+
+// SIMC codeword: tk bits set anywhere in the tuple signature
 
 Bits codewordTuple(char *attr_value, Reln r) {
-	Count tm = tsigBits(r);// width of tuple signature (#bits)
-	Count tk = codeBits(r);// bits set per attribute
-	int counter = 0;
-	Bits cw = newBits(tm);
-	srandom(hash_any(attr_value, strlen(attr_value)));  // seed
-	while (counter < tk) {
-		int i = random() % tm;    // random # from 0 to tm-1
-		if (!bitIsSet(cw,i)){       // check if set to 1
-			setBit(cw,i);
-			counter++;
-		}   
-	}
-	return cw; // m-bits with k 1-bits and m-k 0-bits
+	return relnCodeword(r, attr_value, tsigBits(r), 0, tsigBits(r), codeBits(r));
 }
 
 // make a tuple signature
@@ -38,13 +33,20 @@ Bits makeTupleSig(Reln r, Tuple t)
 	Count n = nAttrs(r);
 	// desc(t) = cw(A1) OR cw(A2) OR ... OR cw(An)
 	// maybe not all n attributes are used in descriptor, say (Perryridge, ?, ?, ?)
+	// CATC: each attribute sets bits only in its own region
 	for (int i = 0; i < n; i++) {
 		// return 0 if same; False is 0
 		if (strcmp(A[i],"?")){
-			Bits cw = codewordTuple(A[i], r); // get codeword for each attribute
+			Bits cw; // get codeword for each attribute
+			if (sigType(r) == 'c')
+				cw = catcCodeword(r, tsigBits(r), 1, i, A[i]);
+			else
+				cw = codewordTuple(A[i], r);
 			orBits(desc,cw);
+			freeBits(cw);
 		}
 	}
+	freeVals(A, n);
 	return desc;
 }
 
@@ -71,11 +73,21 @@ void findPagesUsingTupSigs(Query q)
 	Count tupPP = maxTupsPP(r);
 	
 	// iterate all items in each page
-	for (q->curpage = 0; q->curpage < ntsig; q->curpage++) {
-		Page curr = getPage(tsig_pages, q->curpage); // (File f, PageID pid) => Page
+	// pages are read a run at a time (see getPageRun()), in file order
+	Bits curr_sig = newBitsIn(q->mem, tm);
+	Page run = NULL;
+	Count inrun = 0, nrun = 0;
+	posix_fadvise(tsig_pages, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (q->curpage = 0; q->curpage < ntsig; q->curpage++, inrun++) {
+		if (inrun == nrun) {
+			free(run);
+			nrun = ntsig - q->curpage;
+			run = getPageRun(tsig_pages, q->curpage, &nrun);
+			inrun = 0;
+		}
+		Page curr = pageInRun(run, inrun);
 		Count npitem = pageNitems(curr); // number of items in this page
 		for (q->curtup = 0; q->curtup < npitem; q->curtup++) {
-			Bits curr_sig = newBits(tm);
 			getBits(curr, q->curtup, curr_sig); // get nth item in page, and put in curr_sig
 			if (isSubset(query_sig, curr_sig)){
 				// include PID in Pages, which is nth page in the data file
@@ -92,9 +104,59 @@ void findPagesUsingTupSigs(Query q)
 		}
 		q->nsigpages++; // next page
 	}	
+	free(run);
+	freeBits(query_sig);
 	
 
 	// The printf below is primarily for debugging
 	// Remove it before submitting this function
 	// printf("Matched Pages:"); showBits(q->pages); putchar('\n');
 }
+
+// find "matching" pages using page signatures, then tuple signatures
+// - the psig pass gives candidate data pages
+// - tsigs are stored in tuple order, so the tsigs for a data page
+//   are a contiguous run of entries; only those runs are read
+// - matching tuples are recorded in q->tuples so that the data
+//   scan only looks at those slots
+
+void findPagesUsingPageAndTupSigs(Query q)
+{
+	assert(q != NULL);
+	findPagesUsingPageSigs(q);
+
+	Reln r = q->rel;
+	Bits query_sig = makeTupleSig(r, q->qstring);
+	Bits curr_sig = newBitsIn(q->mem, tsigBits(r));
+	File tsig_pages = tsigFile(r);
+	Count tupPP = maxTupsPP(r);
+	Count tsigPP = maxTsigsPP(r);
+	Count ntups = nTuples(r);
+	q->tuples = newBitsIn(q->mem, nPages(r)*tupPP);
+
+	Page curr = arenaAlloc(q->mem, PAGESIZE);
+	assert(curr != NULL);
+	PageID currpid = NO_PAGE; // tsig page held in curr
+	for (PageID pid = 0; pid < nPages(r); pid++) {
+		if (!bitIsSet(q->pages, pid)) continue;
+		Bool miss = TRUE;
+		Count first = pid*tupPP;
+		Count last = first+tupPP < ntups ? first+tupPP : ntups;
+		for (Count tid = first; tid < last; tid++) {
+			PageID spid = tid / tsigPP;
+			if (spid != currpid) {
+				readPage(tsig_pages, spid, curr);
+				currpid = spid;
+				q->nsigpages++;
+			}
+			getBits(curr, tid % tsigPP, curr_sig);
+			q->nsigs++;
+			if (isSubset(query_sig, curr_sig)) {
+				setBit(q->tuples, tid);
+				miss = FALSE;
+			}
+		}
+		if (miss) unsetBit(q->pages, pid);
+	}
+	freeBits(query_sig);
+}